@@ -6,12 +6,199 @@
 #include <linux/slab.h>         /* kmem_cache            */
 #include <asm/uaccess.h>        /* copy_to_user          */
 #include <linux/sched.h>
+#include <linux/rbtree.h>       /* reservas diferidas    */
+#include <linux/uio.h>          /* iov_iter              */
+#include <linux/parser.h>       /* opciones de montaje   */
+#include <linux/seq_file.h>     /* show_options          */
+#include <linux/workqueue.h>    /* commit periodico      */
+#include <linux/sort.h>         /* particion de hojas    */
+#include <linux/jbd2.h>         /* journal de metadatos  */
+#include <linux/iomap.h>        /* camino de datos       */
+#include <linux/blockgroup_lock.h> /* cerrojos por grupo */
+#include <linux/percpu_counter.h> /* contadores de espacio libre */
+#include <linux/statfs.h>         /* kstatfs               */
+#include <linux/percpu.h>         /* estadisticas por CPU  */
+#include <linux/ktime.h>          /* latencias             */
+#include <linux/kobject.h>        /* /sys/fs/assoofs       */
+#include <linux/jhash.h>          /* cursor de readdir     */
 #include "assoofs.h"
 
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Antía Pérez-Gorostiaga González.");
 
+//Intervalo por defecto (en segundos) entre dos volcados de los metadatos sucios
+#define ASSOOFS_DEFAULT_COMMIT_INTERVAL 5
+
+//Bloques de metadatos que puede modificar cada operacion dentro de una transaccion del journal
+#define ASSOOFS_CREATE_CREDITS 16      /* mapa de bits, superbloque, tabla de inodos e indice del padre */
+#define ASSOOFS_ALLOC_CREDITS 4        /* mapa de bits, bloque de extents y registro del inodo */
+#define ASSOOFS_TRUNCATE_CREDITS 4     /* a partir de ahi, un bloque mas por grupo que se toca */
+#define ASSOOFS_INODE_CREDITS 1
+#define ASSOOFS_REVOKE_CREDITS 4       /* bloques de metadatos que se pueden liberar en la transaccion */
+
+//Reserva diferida: bloques libres que no se prometen a las escrituras porque hacen falta para
+//metadatos (bloques de extents, directorios), y paginas que se asignan de una vez en el writeback
+#define ASSOOFS_DA_META_RESERVE 64
+#define ASSOOFS_DA_MAX_RUN 64
+
+//Bloques de la tabla de inodos y del directorio raiz que se piden por adelantado al montar
+#define ASSOOFS_MOUNT_READAHEAD 8
+
+//Grupo cuyo bloque del mapa de bits aun no se ha leido: sus bloques libres se cuentan al usarlo
+#define ASSOOFS_GROUP_UNCOUNTED UINT_MAX
+
+//Operaciones cuya latencia se mide en /sys/fs/assoofs/<dispositivo>/
+enum assoofs_stat_op {
+    ASSOOFS_OP_READ,
+    ASSOOFS_OP_WRITE,
+    ASSOOFS_OP_LOOKUP,
+    ASSOOFS_OP_CREATE,
+    ASSOOFS_OP_ITERATE,
+    ASSOOFS_OP_MKDIR,
+    ASSOOFS_OP_MAX,
+};
+
+//Sucesos que solo se cuentan
+enum assoofs_stat_event {
+    ASSOOFS_EV_BREAD,           /* bloques de metadatos leidos del disco */
+    ASSOOFS_EV_BREAD_HIT,       /* bloques de metadatos que ya estaban en la cache */
+    ASSOOFS_EV_SYNC_WRITE,      /* escrituras sincronas: sync_dirty_buffer y O_SYNC/O_DSYNC */
+    ASSOOFS_EV_ALLOC,           /* llamadas a assoofs_new_blocks */
+    ASSOOFS_EV_FREE,            /* llamadas a assoofs_free_blocks */
+    ASSOOFS_EV_MAX,
+};
+
+//Cubos del histograma de latencias: el cubo i cuenta las llamadas de [2^i, 2^(i+1)) microsegundos
+//(el 0 tambien las de menos de uno) y el ultimo todas las mas lentas
+#define ASSOOFS_LAT_BUCKETS 20
+
+//Una copia por CPU: cada operacion suma en la suya, sin cerrojos ni lineas de cache compartidas
+struct assoofs_stats {
+    u64 op_calls[ASSOOFS_OP_MAX];
+    u64 op_nsecs[ASSOOFS_OP_MAX];
+    u64 op_hist[ASSOOFS_OP_MAX][ASSOOFS_LAT_BUCKETS];
+    u64 events[ASSOOFS_EV_MAX];
+};
+
+//Informacion del superbloque en memoria (sb->s_fs_info)
+struct assoofs_sb_info {
+    struct assoofs_super_block_info *s_asb;     /* apunta a los datos del buffer del bloque 0 */
+    struct buffer_head *s_sbh;                  /* buffer del bloque 0, retenido mientras esta montado */
+    struct super_block *s_sb;
+    unsigned int s_commit_interval;             /* segundos entre volcados (opcion commit=) */
+    struct delayed_work s_commit_work;
+    unsigned long s_groups_count;               /* grupos de bloques (uno por bloque del mapa de bits) */
+    unsigned int *s_group_free;                 /* bloques libres de cada grupo (o ASSOOFS_GROUP_UNCOUNTED) */
+    struct percpu_counter s_freeblocks_counter; /* bloques libres en total */
+    struct percpu_counter s_dirtyblocks_counter;/* bloques prometidos a escrituras aun sin asignar */
+    struct percpu_counter s_freeinodes_counter; /* numeros de inodo libres */
+    journal_t *s_journal;                       /* NULL si el dispositivo se formateo sin journal */
+    spinlock_t s_inode_lock;                    /* protege inodes_count del superbloque */
+    struct blockgroup_lock s_blockgroup_lock;   /* protege el mapa de bits y s_group_free de cada grupo */
+    struct assoofs_stats __percpu *s_stats;     /* estadisticas de este montaje */
+    struct kobject s_kobj;                      /* /sys/fs/assoofs/<dispositivo> */
+    struct completion s_kobj_unregister;
+};
+
+static inline struct assoofs_sb_info *ASSOOFS_SB(struct super_block *sb) {
+    return sb->s_fs_info;
+}
+
+//Los grupos comparten un numero fijo de cerrojos (bgl), igual que en ext2/ext4
+static inline spinlock_t *assoofs_group_lock(struct assoofs_sb_info *sbi, unsigned long group) {
+    return bgl_lock_ptr(&sbi->s_blockgroup_lock, group);
+}
+
+//Cada CPU acumula hasta percpu_counter_batch antes de volcar en el total: la lectura rapida puede
+//desviarse eso por CPU. Solo cuando el margen es menor que ese error sumo los contadores exactos
+#define ASSOOFS_FREEBLOCKS_WATERMARK (4 * (percpu_counter_batch * num_online_cpus()))
+
+static inline bool assoofs_has_free_blocks(struct assoofs_sb_info *sbi, s64 nblocks) {
+    
+    //DECLARACIONES
+    s64 free_blocks = percpu_counter_read_positive(&sbi->s_freeblocks_counter);
+    s64 dirty_blocks = percpu_counter_read_positive(&sbi->s_dirtyblocks_counter);
+    
+    //Los bloques reservados con mkassoofs -m solo se dan a procesos con CAP_SYS_RESOURCE
+    if (!capable(CAP_SYS_RESOURCE))
+        nblocks += sbi->s_asb->reserved_blocks;
+    
+    if (free_blocks - dirty_blocks < ASSOOFS_FREEBLOCKS_WATERMARK + nblocks) {
+        free_blocks = percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+        dirty_blocks = percpu_counter_sum_positive(&sbi->s_dirtyblocks_counter);
+    }
+    return free_blocks >= dirty_blocks + nblocks;
+}
+
+static inline void assoofs_stat_inc(struct super_block *sb, enum assoofs_stat_event ev) {
+    this_cpu_inc(ASSOOFS_SB(sb)->s_stats->events[ev]);
+}
+
+//Los tracepoints usan ASSOOFS_SB, por eso se incluyen aqui y no con el resto de cabeceras
+#define CREATE_TRACE_POINTS
+#include "assoofs_trace.h"
+
+//Inodo en memoria: la informacion persistente va junto al inodo del VFS, en la misma reserva
+struct assoofs_inode {
+    struct assoofs_inode_info info;
+    struct rw_semaphore i_data_sem;     /* mapa de extents: compartido al leerlo, exclusivo al cambiarlo */
+    spinlock_t i_reserved_lock;         /* protege i_reserved */
+    unsigned int i_reserved;            /* bloques con asignacion diferida (los de i_delalloc) */
+    struct rb_root i_delalloc;          /* tramos diferidos, por bloque logico; bajo i_data_sem */
+    struct inode vfs_inode;
+};
+
+//Tramo de bloques logicos escritos en la cache que aun no tienen bloque en disco: su espacio esta
+//reservado (assoofs_da_reserve) y el writeback los asigna. Dos tramos nunca se tocan ni se solapan
+struct assoofs_da_extent {
+    struct rb_node node;
+    uint32_t lblock;
+    uint32_t len;
+};
+
+static inline struct assoofs_inode *ASSOOFS_INODE(struct inode *inode) {
+    return container_of(inode, struct assoofs_inode, vfs_inode);
+}
+
+static inline struct assoofs_inode_info *ASSOOFS_I(struct inode *inode) {
+    return &ASSOOFS_INODE(inode)->info;
+}
+
+//Los ficheros pequeños guardan su contenido en el registro del inodo, sin bloques de datos
+static inline bool assoofs_has_inline_data(struct inode *inode) {
+    return ASSOOFS_I(inode)->flags & ASSOOFS_INODE_INLINE_DATA;
+}
+
+//Cache de inodos de assoofs
+static struct kmem_cache *assoofs_inode_cache;
+
+//Un nivel del camino recorrido en el indice de un directorio
+struct assoofs_dx_frame {
+    struct buffer_head *bh;
+    struct assoofs_dx_entry *entries;
+    uint32_t *count;
+    uint32_t limit;
+    struct assoofs_dx_entry *at;        /* entrada por la que se baja */
+};
+
+//Entrada en uso de una hoja que se va a partir, para ordenarlas por hash
+struct assoofs_dx_map_entry {
+    uint32_t hash;
+    uint16_t offs;
+    uint16_t size;
+};
+
+//Entrada en uso de una hoja que se esta listando, para emitirlas por orden de cursor
+struct assoofs_dir_cursor {
+    loff_t pos;
+    uint16_t offs;
+};
+
+//Cursores de readdir: 0 y 1 son "." y ".."; el fin del directorio queda por encima de cualquier entrada
+#define ASSOOFS_DIR_EOF_64BIT ((loff_t)LLONG_MAX)
+#define ASSOOFS_DIR_EOF_32BIT ((loff_t)INT_MAX)
+
   /* ----------------------------------------------------------------------------------------- */
  /* -------------------------------------- DECLARACION -------------------------------------- */
 /* ----------------------------------------------------------------------------------------- */
@@ -20,13 +207,125 @@ MODULE_AUTHOR("Antía Pérez-Gorostiaga González.");
  *                                 Operaciones sobre ficheros                                 *
  **********************************************************************************************/
 
-ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos);
+ssize_t assoofs_read(struct kiocb *iocb, struct iov_iter *to);
 
-ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos);
+ssize_t assoofs_write(struct kiocb *iocb, struct iov_iter *from);
 
+static ssize_t assoofs_timed_read(struct kiocb *iocb, struct iov_iter *to);
+
+static ssize_t assoofs_timed_write(struct kiocb *iocb, struct iov_iter *from);
+
+static ssize_t assoofs_dio_rw(struct kiocb *iocb, struct iov_iter *iter, bool wait);
+
+static ssize_t assoofs_dio_read(struct kiocb *iocb, struct iov_iter *to);
+
+static ssize_t assoofs_dio_write(struct kiocb *iocb, struct iov_iter *from);
+
+static ssize_t assoofs_buffered_write(struct kiocb *iocb, struct iov_iter *from);
+
+static ssize_t assoofs_perform_write(struct kiocb *iocb, struct iov_iter *from);
+
+static loff_t assoofs_llseek(struct file *file, loff_t offset, int whence);
+
+int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+
+static int assoofs_file_mmap(struct file *file, struct vm_area_struct *vma);
+
+static vm_fault_t assoofs_page_mkwrite(struct vm_fault *vmf);
+
+//splice y sendfile pasan por la cache de paginas sin copiar a espacio de usuario. copy_file_range
+//entre ficheros de assoofs usa el mismo camino (do_splice_direct)
 const struct file_operations assoofs_file_operations = {
-    .read = assoofs_read,
-    .write = assoofs_write,
+    .llseek = assoofs_llseek,
+    .read_iter = assoofs_timed_read,
+    .write_iter = assoofs_timed_write,
+    .mmap = assoofs_file_mmap,
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
+    .fsync = assoofs_fsync,
+};
+
+static const struct vm_operations_struct assoofs_file_vm_ops = {
+    .fault = filemap_fault,
+    .map_pages = filemap_map_pages,
+    .page_mkwrite = assoofs_page_mkwrite,
+};
+
+/******************************* Sincronizar un archivo *******************************/
+//Sin journal basta con generic_file_fsync. Con journal, los metadatos del inodo pueden estar en una
+//transaccion sin confirmar aunque el inodo ya no este sucio: escribo los datos y fuerzo el commit
+int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync) {
+    
+    //DECLARACIONES
+    struct super_block *sb = file_inode(file)->i_sb;
+    journal_t *journal = ASSOOFS_SB(sb)->s_journal;
+    int aux;
+    
+    if (!journal)
+        return generic_file_fsync(file, start, end, datasync);
+    
+    aux = __generic_file_fsync(file, start, end, datasync);
+    if (!aux)
+        aux = jbd2_journal_force_commit(journal);
+    //Si no habia nada que confirmar, los datos aun pueden estar en la cache del disco
+    if (!aux)
+        aux = blkdev_issue_flush(sb->s_bdev);
+    
+    return aux;
+}
+
+
+/**********************************************************************************************
+ *                           Operaciones sobre la cache de paginas                            *
+ **********************************************************************************************/
+
+static int assoofs_iomap_begin(struct inode *inode, loff_t pos, loff_t length, unsigned flags, struct iomap *iomap, struct iomap *srcmap);
+
+static int assoofs_iomap_delalloc(struct inode *inode, uint32_t iblock, uint32_t len, struct iomap *iomap);
+
+static int assoofs_iomap_end(struct inode *inode, loff_t pos, loff_t length, ssize_t written, unsigned flags, struct iomap *iomap);
+
+static int assoofs_map_blocks(struct iomap_writepage_ctx *wpc, struct inode *inode, loff_t offset);
+
+static void assoofs_inline_fill_folio(struct inode *inode, struct folio *folio);
+
+static int assoofs_inline_convert(struct inode *inode);
+
+static int assoofs_read_folio(struct file *file, struct folio *folio);
+
+static void assoofs_readahead(struct readahead_control *rac);
+
+static int assoofs_writepages(struct address_space *mapping, struct writeback_control *wbc);
+
+static void assoofs_write_failed(struct address_space *mapping, loff_t to);
+
+static sector_t assoofs_bmap(struct address_space *mapping, sector_t block);
+
+//Un solo mapeo por tramos de extents para las lecturas y escrituras a traves de la cache, el
+//direct I/O, los fallos de pagina de un mmap, fiemap, SEEK_HOLE/SEEK_DATA y bmap
+static const struct iomap_ops assoofs_iomap_ops = {
+    .iomap_begin = assoofs_iomap_begin,
+    .iomap_end = assoofs_iomap_end,
+};
+
+//El writeback asigna los bloques diferidos justo antes de escribirlos
+static const struct iomap_writeback_ops assoofs_writeback_ops = {
+    .map_blocks = assoofs_map_blocks,
+};
+
+//Sin buffer_heads: iomap lleva el estado de cada bloque de un folio grande
+const struct address_space_operations assoofs_aops = {
+    .dirty_folio = filemap_dirty_folio,
+    .invalidate_folio = iomap_invalidate_folio,
+    .release_folio = iomap_release_folio,
+    .read_folio = assoofs_read_folio,
+    .readahead = assoofs_readahead,
+    .writepages = assoofs_writepages,
+    .bmap = assoofs_bmap,
+    .direct_IO = noop_direct_IO,
+    .migrate_folio = filemap_migrate_folio,
+    .is_partially_uptodate = iomap_is_partially_uptodate,
+    .error_remove_page = generic_error_remove_page,
 };
 
 /**********************************************************************************************
@@ -35,33 +334,89 @@ const struct file_operations assoofs_file_operations = {
 
 static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
 
+static int assoofs_timed_iterate(struct file *filp, struct dir_context *ctx);
+
+static loff_t assoofs_dir_llseek(struct file *file, loff_t offset, int whence);
+
+static bool assoofs_dir_32bit(struct file *filp);
+
+static loff_t assoofs_dir_cursor(struct file *filp, const char *name, unsigned int len);
+
+static int assoofs_dir_cursor_cmp(const void *a, const void *b);
+
+static int assoofs_iterate_leaf(struct file *filp, struct dir_context *ctx, uint32_t lblock, struct assoofs_dir_cursor *map);
+
 const struct file_operations assoofs_dir_operations = {
     .owner = THIS_MODULE,
-    .iterate = assoofs_iterate,
+    .llseek = assoofs_dir_llseek,
+    .read = generic_read_dir,
+    .iterate_shared = assoofs_timed_iterate,
+    .fsync = assoofs_fsync,
 };
 
 /**********************************************************************************************
  *                                   Operaciones sobre inodos                                 *
  **********************************************************************************************/
 
-static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
+static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
 
-static int assoofs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode);
+static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode);
 
 struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
 
+static int assoofs_timed_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
+
+static struct dentry *assoofs_timed_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags);
+
+static int assoofs_timed_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode);
+
+static int assoofs_setattr(struct user_namespace *mnt_userns, struct dentry *dentry, struct iattr *attr);
+
+static int assoofs_setsize(struct inode *inode, loff_t size);
+
+static int assoofs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len);
+
 static struct inode_operations assoofs_inode_ops = {
-    .create = assoofs_create,
-    .lookup = assoofs_lookup,
-    .mkdir = assoofs_mkdir,
+    .create = assoofs_timed_create,
+    .lookup = assoofs_timed_lookup,
+    .mkdir = assoofs_timed_mkdir,
+    .setattr = assoofs_setattr,
+    .fiemap = assoofs_fiemap,
 };
 
 /**********************************************************************************************
  *                               Operaciones sobre el superbloque                             *
  **********************************************************************************************/
 
+static struct inode *assoofs_alloc_inode(struct super_block *sb);
+
+static void assoofs_free_inode(struct inode *inode);
+
+static void assoofs_evict_inode(struct inode *inode);
+
+static int assoofs_write_inode(struct inode *inode, struct writeback_control *wbc);
+
+static int assoofs_sync_fs(struct super_block *sb, int wait);
+
+static void assoofs_put_super(struct super_block *sb);
+
+static int assoofs_remount(struct super_block *sb, int *flags, char *data);
+
+static int assoofs_statfs(struct dentry *dentry, struct kstatfs *buf);
+
+static int assoofs_show_options(struct seq_file *seq, struct dentry *root);
+
 static const struct super_operations assoofs_sops = {
-    .drop_inode = generic_delete_inode,
+    .alloc_inode = assoofs_alloc_inode,
+    .free_inode = assoofs_free_inode,
+    .drop_inode = generic_drop_inode,
+    .evict_inode = assoofs_evict_inode,
+    .write_inode = assoofs_write_inode,
+    .sync_fs = assoofs_sync_fs,
+    .put_super = assoofs_put_super,
+    .remount_fs = assoofs_remount,
+    .statfs = assoofs_statfs,
+    .show_options = assoofs_show_options,
 };
 
 /**********************************************************************************************
@@ -69,10 +424,10 @@ static const struct super_operations assoofs_sops = {
  **********************************************************************************************/
 
 /** Declaro Struct assoofs_get_inode_info (2.3.3) **/
-struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no);
+int assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info *inode_info);
 
 /** Declaro Struct assoofs_get_inode (2.3.4) **/
-static struct inode *assoofs_get_inode(struct super_block *sb, int ino);
+static struct inode *assoofs_get_inode(struct super_block *sb, uint64_t ino);
 /** Declaro funcion assoofs_sb_get_a_freeblock (2.3.4) **/
 int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block);
 
@@ -82,11 +437,82 @@ void assoofs_save_sb_info(struct super_block *vsb);
 /** Declaro funcion assoofs_add_inode_info (2.3.4) **/
 void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode);
 
+/** Declaro funciones de reserva de numeros de inodo **/
+int assoofs_new_inode_no(struct super_block *sb, uint64_t *ino);
+void assoofs_release_inode_no(struct super_block *sb, uint64_t ino);
+
 /** Declaro funcion assoofs_save_inode_info (2.3.4) **/
 int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info);
 
-/** Declaro funcion assoofs_search_inode_info (2.3.4) **/
-struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search);
+/** Declaro funcion assoofs_update_inode **/
+int assoofs_update_inode(struct inode *inode);
+
+/** Declaro funcion assoofs_read_inode_block **/
+struct buffer_head *assoofs_read_inode_block(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info **record);
+
+/** Declaro funciones de montaje **/
+static int assoofs_parse_options(char *options, struct assoofs_sb_info *sbi);
+static void assoofs_commit_work(struct work_struct *work);
+
+/** Declaro funcion assoofs_dirty_metadata **/
+void assoofs_dirty_metadata(struct super_block *sb, struct buffer_head *bh);
+
+/** Declaro funciones de lectura y escritura sincrona de bloques de metadatos **/
+struct buffer_head *assoofs_bread(struct super_block *sb, uint64_t block);
+int assoofs_sync_buffer(struct super_block *sb, struct buffer_head *bh);
+
+/** Declaro funciones de las estadisticas **/
+static void assoofs_stat_time(struct super_block *sb, enum assoofs_stat_op op, u64 start);
+static int assoofs_sysfs_register(struct super_block *sb);
+static void assoofs_sysfs_unregister(struct super_block *sb);
+
+/** Declaro funciones del journal de metadatos **/
+static int assoofs_journal_load(struct super_block *sb);
+static void assoofs_journal_destroy(struct super_block *sb);
+handle_t *assoofs_journal_start(struct super_block *sb, int nblocks, int revokes);
+int assoofs_journal_stop(handle_t *handle);
+int assoofs_journal_get_write_access(struct super_block *sb, struct buffer_head *bh);
+int assoofs_journal_get_create_access(struct super_block *sb, struct buffer_head *bh);
+int assoofs_journal_extend(struct super_block *sb, int nblocks);
+int assoofs_journal_forget(struct super_block *sb, uint64_t block);
+
+/** Declaro funcion assoofs_sb_free_block **/
+void assoofs_sb_free_block(struct super_block *sb, uint64_t block);
+
+/** Declaro funciones de la reserva diferida **/
+int assoofs_da_reserve(struct inode *inode, uint32_t count);
+void assoofs_da_release(struct inode *inode, uint32_t count);
+static struct assoofs_da_extent *assoofs_da_find(struct assoofs_inode *ai, uint32_t lblock);
+static void assoofs_da_link(struct assoofs_inode *ai, struct assoofs_da_extent *ext);
+static int assoofs_da_add(struct inode *inode, uint32_t lblock, uint32_t len);
+static uint32_t assoofs_da_remove(struct assoofs_inode *ai, uint32_t lblock, uint64_t len);
+static void assoofs_da_punch(struct inode *inode, uint32_t lblock, uint64_t len);
+
+/** Declaro funciones del mapa de bits de bloques **/
+int assoofs_new_blocks(struct super_block *sb, uint64_t goal, uint64_t *block, uint32_t *count);
+void assoofs_free_blocks(struct super_block *sb, uint64_t block, uint32_t count);
+static int assoofs_load_group_counts(struct super_block *sb);
+static void assoofs_count_group(struct super_block *sb, unsigned long group, struct buffer_head *bh);
+static void assoofs_destroy_group_counts(struct assoofs_sb_info *sbi);
+static int assoofs_init_counters(struct assoofs_sb_info *sbi, uint64_t free);
+static void assoofs_mount_readahead(struct super_block *sb, uint64_t block, uint64_t count);
+static int assoofs_mark_fs_dirty(struct super_block *sb);
+static int assoofs_mark_fs_clean(struct super_block *sb);
+
+/** Declaro funciones del mapa de extents **/
+int assoofs_map_block(struct super_block *sb, struct assoofs_inode_info *inode_info, uint32_t iblock, uint64_t *pblock, uint32_t *len);
+int assoofs_alloc_block(struct super_block *sb, struct assoofs_inode_info *inode_info, uint32_t iblock, uint64_t *pblock, uint32_t *len);
+int assoofs_truncate_blocks(struct super_block *sb, struct assoofs_inode_info *inode_info, loff_t size);
+
+/** Declaro funciones del indice de directorios **/
+static struct buffer_head *assoofs_dir_bread(struct inode *dir, uint32_t lblock);
+static int assoofs_dir_set_size(struct inode *dir);
+static struct assoofs_dir_record_entry *assoofs_dir_entry(struct buffer_head *bh, unsigned int offset);
+static int assoofs_dx_init(struct inode *dir);
+static int assoofs_dx_probe(struct inode *dir, uint32_t hash, struct assoofs_dx_frame *frames, uint32_t *levels);
+static void assoofs_dx_release(struct assoofs_dx_frame *frames);
+int assoofs_dx_find_entry(struct inode *dir, const char *name, unsigned int len, uint64_t *ino);
+int assoofs_dx_add_entry(struct inode *dir, const char *name, unsigned int len, uint64_t ino, umode_t mode);
 
 
   /* ----------------------------------------------------------------------------------------- */
@@ -98,311 +524,962 @@ struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, str
  **********************************************************************************************/
 
 /******************************* Leer un archivo  *******************************/
-ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos) {
+//La lectura se sirve desde la cache de paginas; los bloques se traen con assoofs_read_folio/assoofs_readahead
+ssize_t assoofs_read(struct kiocb *iocb, struct iov_iter *to) {
    
     //DECLARACIONES
-    int nbytes = 0;
-    //Obtengo la informacion persistente del inodo a partir de filp
-    struct assoofs_inode_info *inode_info = filp->f_path.dentry->d_inode->i_private;
-    struct buffer_head *bh;
-    char *buffer;
+    ssize_t nbytes;
     
-    printk(KERN_INFO "\n********** Llamada a Read **********\n");
+    if (iocb->ki_flags & IOCB_DIRECT)
+        nbytes = assoofs_dio_read(iocb, to);
+    else
+        nbytes = generic_file_read_iter(iocb, to);
     
-    //Compruebo el valor de ppos por si alcanzo el final del fichero
-    if(*ppos >= inode_info->file_size){
-        printk(KERN_INFO "      READ - Final del Fichero Alcanzado.\n");
-        return 0;
-    }
+    //Devuelvo el numero de bytes leidos
+    return nbytes;
+}
+
+/******************************* Escribir en un archivo *******************************/
+//La escritura se copia en la cache de paginas (assoofs_buffered_write) y llega a disco en el writeback
+ssize_t assoofs_write(struct kiocb *iocb, struct iov_iter *from) {
+      
+    //DECLARACIONES
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t nbytes;
     
-    //Accedo al contenido del fichero
-    bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
+    inode_lock(inode);
     
-    if(!bh){
-        printk(KERN_INFO "      READ - Fallo en la lectura del bloque.\n");
-        return 0;
-    }
+    nbytes = generic_write_checks(iocb, from);
+    if (nbytes > 0 && (iocb->ki_flags & IOCB_DIRECT))
+        nbytes = assoofs_dio_write(iocb, from);
+    else if (nbytes > 0)
+        nbytes = assoofs_buffered_write(iocb, from);
     
-    buffer = (char *)bh->b_data;
+    //Si el fichero crece, assoofs_iomap_end marca el inodo como sucio y el nuevo
+    //tamaño llega al almacen de inodos con assoofs_write_inode
+    inode_unlock(inode);
     
-    //Comparo len con el tamaño del fichero por si llego al final
-    nbytes = min((size_t) inode_info->file_size, len);
+    //Con O_SYNC/O_DSYNC espero a que los datos lleguen a disco
+    if (nbytes > 0 && iocb_is_dsync(iocb))
+        assoofs_stat_inc(inode->i_sb, ASSOOFS_EV_SYNC_WRITE);
+    if (nbytes > 0)
+        nbytes = generic_write_sync(iocb, nbytes);
     
-    //Copio en el buffer el contenido del fichero leido en el paso anterior
-    if(copy_to_user(buf, buffer, nbytes)){
-        //Libero
-        brelse(bh);
-        printk(KERN_INFO "      READ - Error copiando el contenido del fichero al buffer de espacio usuario.\n");
-        return -EFAULT;
-    }
+    //Devuelvo el numero de bytes escritos
+    return nbytes;
+}
+
+
+/******************************* Funcion assoofs_dio_rw *******************************/
+//Direct I/O (O_DIRECT): la parte de la peticion que acaba en un limite de bloque va directamente
+//entre el buffer del usuario y el dispositivo. La cola que no llega a un bloque entero, o todo un
+//fichero inline, se deja en iter para que quien llama la termine a traves de la cache. Con wait
+//espero a que acabe aunque la peticion sea asincrona, porque despues hay que seguir con ella
+static ssize_t assoofs_dio_rw(struct kiocb *iocb, struct iov_iter *iter, bool wait) {
     
-    brelse(bh);
+    //DECLARACIONES
+    struct inode *inode = file_inode(iocb->ki_filp);
+    size_t count = iov_iter_count(iter);
+    size_t tail = (iocb->ki_pos + count) & (i_blocksize(inode) - 1);
+    ssize_t ret;
     
-    //Incremento el valor de ppos
-    *ppos += nbytes;
+    if (assoofs_has_inline_data(inode) || tail >= count)
+        return 0;
     
-    printk(KERN_INFO "********** Fin llamada a Read **********\n");
+    iov_iter_truncate(iter, count - tail);
+    ret = iomap_dio_rw(iocb, iter, &assoofs_iomap_ops, NULL, (wait || tail) ? IOMAP_DIO_FORCE_WAIT : 0, NULL, 0);
+    iov_iter_reexpand(iter, iov_iter_count(iter) + tail);
     
-    //Devuelvo el numero de bytes leidos
-    return nbytes;
+    return ret;
 }
 
-/******************************* Escribir en un archivo *******************************/
-ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos) {
-      
+/******************************* Lectura directa *******************************/
+static ssize_t assoofs_dio_read(struct kiocb *iocb, struct iov_iter *to) {
+    
     //DECLARACIONES
-     //Obtengo la informacion persistente del inodo a partir de filp
-    struct assoofs_inode_info *inode_info = filp->f_path.dentry->d_inode->i_private;
-    struct buffer_head *bh;
-    struct super_block *sb;
-    char *buffer;
-    int aux = 0;
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t nbytes;
     
-    printk(KERN_INFO "\n********** Llamada a Write **********\n");
+    if (!iov_iter_count(to))
+        return 0;
     
-    printk(KERN_INFO "      WRITE - Intentamos escribir %lu Bytes en el inodo %lu.\n", len, filp -> f_path.dentry -> d_inode -> i_ino);
+    //i_rwsem compartido: un truncate no puede liberar los bloques mientras se leen
+    inode_lock_shared(inode);
+    nbytes = assoofs_dio_rw(iocb, to, false);
+    inode_unlock_shared(inode);
     
-    sb = filp->f_path.dentry->d_inode->i_sb;
+    if (nbytes < 0 || !iov_iter_count(to) || iocb->ki_pos >= i_size_read(inode))
+        return nbytes;
     
-    if (aux) return aux;
+    //El resto se lee de la cache de paginas
+    return filemap_read(iocb, to, nbytes);
+}
+
+/******************************* Escritura directa *******************************/
+//Se llama con i_rwsem cogido. Lo que no se puede escribir directamente pasa por la cache y se
+//escribe a disco antes de volver, como espera quien abre con O_DIRECT
+static ssize_t assoofs_dio_write(struct kiocb *iocb, struct iov_iter *from) {
     
-    //Compruebo el valor de ppos por si alcanzo el final del fichero
-    bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
+    //DECLARACIONES
+    struct file *file = iocb->ki_filp;
+    struct inode *inode = file_inode(file);
+    loff_t end = iocb->ki_pos + iov_iter_count(from);
+    loff_t pos;
+    ssize_t written, buffered;
+    int aux;
     
-    if (!bh) {
-        printk(KERN_ERR "      WRITE -  Leyendo el numero de bloque [%llu] failed.\n", inode_info -> data_block_number);
-        return 0;
+    aux = file_remove_privs(file);
+    if (!aux)
+        aux = file_update_time(file);
+    if (aux)
+        return aux;
+    
+    /** 1. Parte alineada. Si alarga el fichero espero a que acabe para actualizar el tamaño con i_rwsem cogido **/
+    written = assoofs_dio_rw(iocb, from, end > i_size_read(inode));
+    if (written < 0) {
+        //Devuelvo los bloques que se hubieran asignado mas alla del final
+        if (written != -EIOCBQUEUED && end > i_size_read(inode))
+            assoofs_write_failed(inode->i_mapping, end);
+        return written;
     }
     
-    buffer = (char *) bh -> b_data;
-    printk(KERN_INFO "      WRITE - Valor del Buffer = %s.\n", buffer);
-    buffer += *ppos;
-    
-    //Escribo en el fichero los datos obtenidos de buf 
-    if(copy_from_user(buffer, buf, len)){
-        //Libero
-        brelse(bh);
-        printk(KERN_INFO "      WRITE - Error copiando el contenido del buffer de espacio usuario al espacio kernel.\n");
-        return -EFAULT;
+    if (iocb->ki_pos > i_size_read(inode)) {
+        i_size_write(inode, iocb->ki_pos);
+        mark_inode_dirty(inode);
     }
     
-    //Incremento el valor de ppos
-    *ppos += len;
-    
-    //Marco el bloque como sucio
-    mark_buffer_dirty(bh);
-    //Sincronizo
-    sync_dirty_buffer(bh);
-    //Libero
-    brelse(bh);
+    if (!iov_iter_count(from))
+        return written;
     
-    //Actualizo el campo file_size de la informacion persistente en el nodo
-    inode_info->file_size = *ppos;
+    /** 2. El resto pasa por la cache de paginas **/
+    pos = iocb->ki_pos;
+    iocb->ki_flags &= ~IOCB_DIRECT;
+    buffered = assoofs_perform_write(iocb, from);
+    iocb->ki_flags |= IOCB_DIRECT;
+    if (buffered <= 0)
+        return written ? written : buffered;
     
-    printk(KERN_INFO "      WRITE - Guardando inode_no. %llu .\n", inode_info->inode_no);
+    aux = filemap_write_and_wait_range(inode->i_mapping, pos, pos + buffered - 1);
+    if (aux)
+        return written ? written : aux;
+    invalidate_mapping_pages(inode->i_mapping, pos >> PAGE_SHIFT, (pos + buffered - 1) >> PAGE_SHIFT);
     
-    aux = assoofs_save_inode_info(sb, inode_info);
+    iocb->ki_pos = pos + buffered;
+    return written + buffered;
+}
+
+/******************************* Escritura a traves de la cache *******************************/
+//Se llama con i_rwsem cogido. iomap copia los datos en la cache de paginas, folio a folio, y
+//assoofs_iomap_begin reserva de una vez los bloques que faltan en cada tramo
+static ssize_t assoofs_buffered_write(struct kiocb *iocb, struct iov_iter *from) {
     
-    if (aux) len = aux;
+    //DECLARACIONES
+    struct file *file = iocb->ki_filp;
+    ssize_t nbytes;
+    int aux;
     
-    printk(KERN_INFO "      WRITE - Escribiendo %lu Bytes en inodo %lu.\n",  len, filp -> f_path.dentry -> d_inode -> i_ino);
+    aux = file_remove_privs(file);
+    if (!aux)
+        aux = file_update_time(file);
+    if (aux)
+        return aux;
     
-    printk(KERN_INFO "********** Fin llamada a Write **********\n");
+    current->backing_dev_info = inode_to_bdi(file_inode(file));
+    nbytes = assoofs_perform_write(iocb, from);
+    current->backing_dev_info = NULL;
     
-    //Devuelvo el numero de bytes escritos
-    return len;
+    return nbytes;
 }
 
-
-/**********************************************************************************************
- *                               Operaciones sobre directorios                                *
- **********************************************************************************************/
-
-/******************************* Mostrar contenido de directorio ******************************/
-static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
+/******************************* Funcion assoofs_perform_write *******************************/
+//Mientras quepa en el registro, un fichero inline se escribe en el y en la pagina 0, sin reservar
+//bloques; la pagina queda limpia, porque lo que llega a disco es el registro (assoofs_write_inode).
+//Si no cabe sale antes del registro, y todo lo demas lo escribe iomap
+static ssize_t assoofs_perform_write(struct kiocb *iocb, struct iov_iter *from) {
     
     //DECLARACIONES
-    struct inode *inode;
-    struct super_block *sb;
-    struct buffer_head *bh;
-    struct assoofs_dir_record_entry *record;
-    struct assoofs_inode_info *inode_info;
-    int i = 0;
+    struct inode *inode = file_inode(iocb->ki_filp);
+    char buf[ASSOOFS_INLINE_DATA_MAX];
+    struct folio *folio;
+    loff_t pos = iocb->ki_pos;
+    size_t len = iov_iter_count(from);
+    int aux;
+    
+    if (!assoofs_has_inline_data(inode))
+        return iomap_file_buffered_write(iocb, from, &assoofs_iomap_ops);
+    
+    if (pos + len > ASSOOFS_INLINE_DATA_MAX) {
+        aux = assoofs_inline_convert(inode);
+        if (aux)
+            return aux;
+        return iomap_file_buffered_write(iocb, from, &assoofs_iomap_ops);
+    }
     
-    printk(KERN_INFO "\n********** Llamada a Iterate **********\n");
+    //Copio antes de bloquear la pagina: el buffer del usuario puede ser un mmap de esta misma pagina
+    len = copy_from_iter(buf, len, from);
+    if (!len)
+        return -EFAULT;
     
-    /** 1. Accedo al inodo, a la indo persist del inodo, y al superbloq correcpond al arg filp **/
-    inode = filp->f_path.dentry->d_inode;
-    sb = inode->i_sb;
-    inode_info = inode->i_private;
+    folio = __filemap_get_folio(inode->i_mapping, 0, FGP_LOCK | FGP_WRITE | FGP_CREAT | FGP_STABLE, mapping_gfp_mask(inode->i_mapping));
+    if (!folio) {
+        iov_iter_revert(from, len);
+        return -ENOMEM;
+    }
     
-    /** 2. Compruebo si el contexto del directorio ya esta creado **/
-    if(ctx->pos) return 0;
+    //Un fallo de pagina en un mmap puede haberlo sacado del registro mientras esperaba
+    if (!assoofs_has_inline_data(inode)) {
+        folio_unlock(folio);
+        folio_put(folio);
+        iov_iter_revert(from, len);
+        return iomap_file_buffered_write(iocb, from, &assoofs_iomap_ops);
+    }
     
-    /** 3. Compruebo que el inodo obtenido en el paso 1 se corresponde con un directorio **/
-    if((!S_ISDIR(inode_info->mode))) return -1;
+    if (!folio_test_uptodate(folio))
+        assoofs_inline_fill_folio(inode, folio);
+    memcpy(ASSOOFS_I(inode)->inline_data + pos, buf, len);
+    memcpy_to_page(&folio->page, pos, buf, len);
+    if (pos + len > inode->i_size)
+        i_size_write(inode, pos + len);
+    folio_unlock(folio);
+    folio_put(folio);
+    
+    mark_inode_dirty(inode);
+    iocb->ki_pos += len;
+    return len;
+}
+
+/******************************* Posicionamiento (lseek) *******************************/
+//SEEK_HOLE y SEEK_DATA se resuelven con el mapa de extents. Los bloques diferidos aun no estan en
+//el mapa, asi que antes escribo las paginas sucias
+static loff_t assoofs_llseek(struct file *file, loff_t offset, int whence) {
     
-    /** 4. Accedo al bloq dd se almacena el cont del dir y con la info que cont ini el contex ctx **/
-    bh = sb_bread(sb, inode_info->data_block_number);
-    record = (struct assoofs_dir_record_entry *) bh->b_data;
+    //DECLARACIONES
+    struct inode *inode = file_inode(file);
+    int aux;
     
-    for (i = 0; i < inode_info->dir_children_count; i++){
+    if (whence != SEEK_HOLE && whence != SEEK_DATA)
+        return generic_file_llseek(file, offset, whence);
     
-    	dir_emit(ctx, record->filename, ASSOOFS_FILENAME_MAXLEN, record->inode_no, DT_UNKNOWN);
-    	ctx->pos += sizeof(struct assoofs_dir_record_entry);
-    	record++;
-    }
-    //Libero
-    brelse(bh);
+    aux = filemap_write_and_wait(inode->i_mapping);
+    if (aux)
+        return aux;
     
-    printk(KERN_INFO "********** Fin llamada a Iterate **********\n");
+    inode_lock_shared(inode);
+    if (whence == SEEK_HOLE)
+        offset = iomap_seek_hole(inode, offset, &assoofs_iomap_ops);
+    else
+        offset = iomap_seek_data(inode, offset, &assoofs_iomap_ops);
+    inode_unlock_shared(inode);
+    
+    if (offset < 0)
+        return offset;
+    return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
 
+/******************************* Proyeccion en memoria (mmap) *******************************/
+//Las lecturas se resuelven con filemap_fault desde la cache de paginas
+static int assoofs_file_mmap(struct file *file, struct vm_area_struct *vma) {
+    file_accessed(file);
+    vma->vm_ops = &assoofs_file_vm_ops;
     return 0;
 }
 
+/******************************* Primera escritura en una pagina proyectada *******************************/
+//Reservo los bloques del folio igual que una escritura, para que el writeback no se quede sin
+//sitio. Un fichero inline sale antes del registro: la pagina sucia tiene que llegar a un bloque
+static vm_fault_t assoofs_page_mkwrite(struct vm_fault *vmf) {
+    
+    //DECLARACIONES
+    struct inode *inode = file_inode(vmf->vma->vm_file);
+    vm_fault_t ret;
+    int aux = 0;
+    
+    sb_start_pagefault(inode->i_sb);
+    file_update_time(vmf->vma->vm_file);
+    
+    //Un truncate no puede liberar los bloques de la pagina mientras se reservan
+    filemap_invalidate_lock_shared(inode->i_mapping);
+    if (assoofs_has_inline_data(inode))
+        aux = assoofs_inline_convert(inode);
+    ret = aux ? block_page_mkwrite_return(aux) : iomap_page_mkwrite(vmf, &assoofs_iomap_ops);
+    filemap_invalidate_unlock_shared(inode->i_mapping);
+    
+    sb_end_pagefault(inode->i_sb);
+    return ret;
+}
+
 
 /**********************************************************************************************
- *                                   Operaciones sobre inodos                                 *
+ *                           Operaciones sobre la cache de paginas                            *
  **********************************************************************************************/
 
-/************************** Creación de nuevos inodos para archivos ****************************/
-static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
+/******************************* Funcion assoofs_iomap_begin ***********************************/
+//Describe de una vez el tramo de extents (o el hueco) en el que empieza pos. Las escrituras directas
+//asignan aqui los huecos, en tramos de hasta ASSOOFS_DA_MAX_RUN bloques; las escrituras a traves de
+//la cache (y los fallos de pagina de un mmap) solo los reservan, con assoofs_iomap_delalloc
+static int assoofs_iomap_begin(struct inode *inode, loff_t pos, loff_t length, unsigned flags, struct iomap *iomap, struct iomap *srcmap) {
     
     //DECLARACIONES
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    unsigned int blkbits = inode->i_blkbits;
+    uint64_t pblock;
+    uint32_t iblock, want, run, len;
+    handle_t *handle;
     int aux;
-    uint64_t count;
-    struct inode *inode;
-    struct assoofs_inode_info *inode_info;
-    struct assoofs_inode_info *parent_inode_info;
-    struct assoofs_dir_record_entry *dir_contents;
-    struct super_block *sb;
-    struct buffer_head *bh;
-    
-    printk(KERN_INFO "\n********** Llamada a Create **********\n");
-    
-    /** 1. Creo nuevo inodo **/
-    // obtengo un puntero al superbloque desde dir
-    sb = dir->i_sb;
-    
-    // obtengo el número de inodos de la informacion persistente del superbloque
-    count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count;
     
-    //Compruebo que el valor de count no es superior al numero maximo de objetos soportados
-    if(count >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
-        printk(KERN_ERR"ERROR, El archivo esta completo.\n" );
-        return -12;
+    if ((pos >> blkbits) > U32_MAX)
+        return -EFBIG;
+    iblock = pos >> blkbits;
+    want = min_t(u64, ((pos + length - 1) >> blkbits) - iblock + 1, U32_MAX - iblock);
+    
+    iomap->bdev = sb->s_bdev;
+    iomap->flags = 0;
+    iomap->offset = (u64)iblock << blkbits;
+    iomap->addr = IOMAP_NULL_ADDR;
+    
+    /** 1. Fichero inline: los datos estan en el registro del inodo **/
+    if (assoofs_has_inline_data(inode)) {
+        if (pos < i_size_read(inode)) {
+            iomap->type = IOMAP_INLINE;
+            iomap->inline_data = inode_info->inline_data;
+            iomap->offset = 0;
+            iomap->length = i_size_read(inode);
+        }
+        else {
+            iomap->type = IOMAP_HOLE;
+            iomap->length = (u64)want << blkbits;
+        }
+        return 0;
     }
     
-    //Nuevo inodo
-    inode = new_inode(sb);
+    down_read(&ASSOOFS_INODE(inode)->i_data_sem);
+    aux = assoofs_map_block(sb, inode_info, iblock, &pblock, &run);
+    up_read(&ASSOOFS_INODE(inode)->i_data_sem);
+    if (aux < 0)
+        return aux;
+    
+    /** 2. Bloques asignados **/
+    if (aux > 0) {
+        iomap->type = IOMAP_MAPPED;
+        iomap->addr = pblock << blkbits;
+        iomap->length = (u64)min(run, want) << blkbits;
+        return 0;
+    }
     
-    // Asigno numero al nuevo inodo a partir de count
-    inode->i_ino = (count + ASSOOFS_START_INO - ASSOOFS_RESERVED_INODES + 1);
-        
-    //Guardo el superbloque en el inodo
-    inode->i_sb = sb;
+    /** 3. Hueco. Las lecturas y la puesta a cero de un truncate lo ven como tal **/
+    len = run ? min(run, want) : want;
+    if (!(flags & IOMAP_WRITE) || (flags & IOMAP_ZERO)) {
+        iomap->type = IOMAP_HOLE;
+        iomap->length = (u64)len << blkbits;
+        return 0;
+    }
     
-    inode->i_op = &assoofs_inode_ops;
-            
-    // fechas.
-	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);      
+    if (!(flags & IOMAP_DIRECT))
+        return assoofs_iomap_delalloc(inode, iblock, len, iomap);
+    
+    len = min_t(uint32_t, len, ASSOOFS_DA_MAX_RUN);
+    handle = assoofs_journal_start(sb, ASSOOFS_ALLOC_CREDITS, 0);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+    down_write(&ASSOOFS_INODE(inode)->i_data_sem);
+    aux = assoofs_alloc_block(sb, inode_info, iblock, &pblock, &len);
+    if (!aux)
+        aux = assoofs_update_inode(inode);
+    up_write(&ASSOOFS_INODE(inode)->i_data_sem);
+    assoofs_journal_stop(handle);
+    if (aux)
+        return aux;
+    
+    //Igual que en el writeback: un buffer viejo de estos bloques (metadatos liberados) no puede
+    //acabar escrito encima de lo que escriba el direct I/O
+    clean_bdev_aliases(sb->s_bdev, pblock, len);
+    
+    //IOMAP_F_NEW: iomap pone a cero lo que la escritura no cubra de los bloques nuevos
+    iomap->type = IOMAP_MAPPED;
+    iomap->flags = IOMAP_F_NEW;
+    iomap->addr = pblock << blkbits;
+    iomap->length = (u64)len << blkbits;
+    return 0;
+}
+
+/******************************* Funcion assoofs_iomap_delalloc ********************************/
+//Hueco de len bloques en iblock bajo una escritura a traves de la cache. Si iblock ya esta diferido
+//devuelvo ese tramo; si no, reservo de una vez los bloques del hueco hasta el siguiente tramo
+//diferido. Vuelvo a mirar el mapa con i_data_sem exclusivo: entre tanto el writeback ha podido
+//asignar el bloque y sacarlo del arbol
+static int assoofs_iomap_delalloc(struct inode *inode, uint32_t iblock, uint32_t len, struct iomap *iomap) {
     
-    inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
+    //DECLARACIONES
+    struct assoofs_inode *ai = ASSOOFS_INODE(inode);
+    struct assoofs_da_extent *ext;
+    unsigned int blkbits = inode->i_blkbits;
+    uint64_t pblock;
+    uint32_t run;
+    int aux;
     
-    // El segundo mode me llega como argumento
-    inode_info->mode = mode;
+    down_write(&ai->i_data_sem);
+    aux = assoofs_map_block(inode->i_sb, &ai->info, iblock, &pblock, &run);
+    if (aux > 0) {
+        iomap->type = IOMAP_MAPPED;
+        iomap->addr = pblock << blkbits;
+        len = min(run, len);
+    }
+    else if (!aux) {
+        if (run)
+            len = min(run, len);
+        iomap->type = IOMAP_DELALLOC;
+        ext = assoofs_da_find(ai, iblock);
+        if (ext && ext->lblock <= iblock)
+            len = min_t(u64, (u64)ext->lblock + ext->len - iblock, len);
+        else {
+            if (ext)
+                len = min(ext->lblock - iblock, len);
+            aux = assoofs_da_add(inode, iblock, len);
+            //IOMAP_F_NEW: los bloques acaban de reservarse, assoofs_iomap_end devuelve lo que no se escriba
+            iomap->flags = IOMAP_F_NEW;
+        }
+    }
+    up_write(&ai->i_data_sem);
+    if (aux < 0)
+        return aux;
     
-    inode_info->inode_no = inode->i_ino; /** hhhhhh **/
+    iomap->length = (u64)len << blkbits;
+    return 0;
+}
+
+/******************************* Funcion assoofs_iomap_end *************************************/
+//Tras cada tramo: si el fichero ha crecido, el tamaño tiene que llegar al registro; y si una
+//escritura se queda corta, devuelvo la reserva de los bloques que ha dejado sin tocar
+static int assoofs_iomap_end(struct inode *inode, loff_t pos, loff_t length, ssize_t written, unsigned flags, struct iomap *iomap) {
     
-    printk(KERN_INFO "      CREATE - Solicitud de creación de nuevo archivo %s.", dentry -> d_name.name);
+    //DECLARACIONES
+    unsigned int blkbits = inode->i_blkbits;
+    loff_t start = round_up(pos + written, i_blocksize(inode));
+    loff_t end = iomap->offset + iomap->length;
     
-    inode_info->file_size = 0;
+    if (iomap->flags & IOMAP_F_SIZE_CHANGED)
+        mark_inode_dirty(inode);
     
-    //Para las operaciones sobre ficheros
-    inode->i_fop = &assoofs_file_operations;
+    if (iomap->type != IOMAP_DELALLOC || !(iomap->flags & IOMAP_F_NEW) || start >= end)
+        return 0;
     
-    //Funcion auxiliar para asignarle un bloque al nuevo inodo
-    aux = assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number);
+    //iomap ya ha quitado de la cache lo que quedaba fuera del fichero. Si en el resto hay algun folio
+    //sucio (un mmap lo ha escrito entretanto) dejo la reserva: se devuelve al recortar el fichero
+    if (filemap_range_needs_writeback(inode->i_mapping, start, end - 1))
+        return 0;
     
-    //Control de errores
-    if(aux < 0){
-    	printk(KERN_ERR "Simplefs no tiene un bloque libre.\n");
-        return -1;
+    assoofs_da_punch(inode, start >> blkbits, (end - start) >> blkbits);
+    return 0;
+}
+
+/******************************* Funcion assoofs_inline_fill_folio *****************************/
+//Copia en el folio el contenido inline del fichero (solo puede estar en el bloque 0) y pone a
+//cero el resto
+static void assoofs_inline_fill_folio(struct inode *inode, struct folio *folio) {
+    
+    //DECLARACIONES
+    size_t size = 0;
+    
+    if (folio->index == 0)
+        size = min_t(loff_t, i_size_read(inode), ASSOOFS_INLINE_DATA_MAX);
+    
+    memcpy_to_page(&folio->page, 0, ASSOOFS_I(inode)->inline_data, size);
+    folio_zero_segment(folio, size, folio_size(folio));
+    folio_mark_uptodate(folio);
+}
+
+/******************************* Funcion assoofs_inline_convert ********************************/
+//Saca del registro el contenido de un fichero inline que va a crecer por encima del limite. Lo
+//dejo en el folio 0 como un bloque diferido y sucio, de modo que el writeback le asigna un bloque
+//igual que a cualquier otra escritura. La marca inline solo cambia con el folio 0 bloqueado, asi
+//que quien lo tenga bloqueado puede fiarse de ella
+static int assoofs_inline_convert(struct inode *inode) {
+    
+    //DECLARACIONES
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    struct folio *folio;
+    handle_t *handle;
+    int aux = 0;
+    
+    folio = __filemap_get_folio(inode->i_mapping, 0, FGP_LOCK | FGP_WRITE | FGP_CREAT | FGP_STABLE, mapping_gfp_mask(inode->i_mapping));
+    if (!folio)
+        return -ENOMEM;
+    
+    //Otro (write, truncate o un fallo de pagina en un mmap) se ha adelantado
+    if (!assoofs_has_inline_data(inode)) {
+        folio_unlock(folio);
+        folio_put(folio);
+        return 0;
+    }
+    
+    if (!folio_test_uptodate(folio))
+        assoofs_inline_fill_folio(inode, folio);
+    
+    //Los extents ocupan el sitio de los datos inline: borro la marca a la vez que reservo el bloque,
+    //antes de que el writeback pueda asignarlo. Sin sitio para el, el fichero se queda inline
+    down_write(&ASSOOFS_INODE(inode)->i_data_sem);
+    if (i_size_read(inode))
+        aux = assoofs_da_add(inode, 0, 1);
+    if (!aux) {
+        inode_info->flags &= ~ASSOOFS_INODE_INLINE_DATA;
+        memset(inode_info->inline_data, 0, ASSOOFS_INLINE_DATA_MAX);
+    }
+    up_write(&ASSOOFS_INODE(inode)->i_data_sem);
+    
+    if (!aux && i_size_read(inode))
+        folio_mark_dirty(folio);
+    folio_unlock(folio);
+    folio_put(folio);
+    if (aux)
+        return aux;
+    
+    handle = assoofs_journal_start(inode->i_sb, ASSOOFS_INODE_CREDITS, 0);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+    aux = assoofs_update_inode(inode);
+    assoofs_journal_stop(handle);
+    
+    return aux;
+}
+
+/******************************* Lectura de paginas *******************************/
+//iomap junta en cada bio todo el tramo de extents, y la cache puede usar folios grandes
+static int assoofs_read_folio(struct file *file, struct folio *folio) {
+    
+    //Un fichero inline se lee del registro del inodo, que ya esta en memoria
+    if (assoofs_has_inline_data(folio->mapping->host)) {
+        assoofs_inline_fill_folio(folio->mapping->host, folio);
+        folio_unlock(folio);
+        return 0;
     }
     
-    //Incluimos campo i_private
-    inode->i_private = inode_info;
+    return iomap_read_folio(folio, &assoofs_iomap_ops);
+}
+
+static void assoofs_readahead(struct readahead_control *rac) {
     
-    //Funcion auxiliar para guardar la informacion persistente del nuevo inodo en disco
-    assoofs_add_inode_info(sb, inode_info);
+    //Sin bloques no hay nada que adelantar: las paginas se leen con assoofs_read_folio
+    if (assoofs_has_inline_data(rac->mapping->host))
+        return;
+    
+    iomap_readahead(rac, &assoofs_iomap_ops);
+}
+
+/******************************* Funcion assoofs_map_blocks ************************************/
+//Mapeo de un bloque sucio para el writeback. Si es diferido asigno de una vez, en la misma
+//transaccion, hasta ASSOOFS_DA_MAX_RUN bloques de su tramo diferido: los folios sucios que siguen
+//se escriben seguidos en disco. El mapeo anterior sirve mientras offset caiga dentro
+static int assoofs_map_blocks(struct iomap_writepage_ctx *wpc, struct inode *inode, loff_t offset) {
     
-    /** 2. Modifico el contenido del directorio padre **/
-    parent_inode_info = dir->i_private;
+    //DECLARACIONES
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_INODE(inode);
+    struct assoofs_da_extent *ext;
+    struct iomap *iomap = &wpc->iomap;
+    unsigned int blkbits = inode->i_blkbits;
+    uint32_t iblock = offset >> blkbits, len = 1, released = 0;
+    uint64_t pblock;
+    handle_t *handle;
+    int aux;
+    
+    if (offset >= iomap->offset && offset < iomap->offset + iomap->length)
+        return 0;
     
-    bh = sb_bread(sb, parent_inode_info->data_block_number);
+    aux = assoofs_iomap_begin(inode, offset, sb->s_maxbytes - offset, 0, iomap, NULL);
+    if (aux || iomap->type != IOMAP_HOLE)
+        return aux;
+    
+    handle = assoofs_journal_start(sb, ASSOOFS_ALLOC_CREDITS, 0);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+    
+    down_write(&ai->i_data_sem);
+    ext = assoofs_da_find(ai, iblock);
+    if (ext && ext->lblock <= iblock) {
+        len = min_t(u64, (u64)ext->lblock + ext->len - iblock, ASSOOFS_DA_MAX_RUN);
+        len = min_t(u64, iomap->length >> blkbits, len);
+        aux = assoofs_alloc_block(sb, &ai->info, iblock, &pblock, &len);
+        if (!aux) {
+            released = assoofs_da_remove(ai, iblock, len);
+            aux = assoofs_update_inode(inode);
+        }
+    }
+    up_write(&ai->i_data_sem);
+    assoofs_journal_stop(handle);
+    
+    //Los bloques diferidos ya estan asignados: su reserva pasa a ser espacio ocupado de verdad
+    if (released)
+        assoofs_da_release(inode, released);
+    if (aux)
+        return aux;
+    
+    //Un hueco que no esta diferido no tiene nada sucio que escribir: iomap se lo salta
+    iomap->offset = (u64)iblock << blkbits;
+    iomap->length = (u64)len << blkbits;
+    if (released) {
+        //En la cache del dispositivo puede quedar un buffer viejo de estos bloques (metadatos liberados)
+        clean_bdev_aliases(sb->s_bdev, pblock, len);
+        iomap->type = IOMAP_MAPPED;
+        iomap->addr = pblock << blkbits;
+    }
+    return 0;
+}
+
+/******************************* Escritura de paginas a disco *******************************/
+//iomap junta en cada bio los folios sucios que quedan seguidos en disco
+static int assoofs_writepages(struct address_space *mapping, struct writeback_control *wbc) {
     
-    dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
-    dir_contents += parent_inode_info->dir_children_count;
+    //DECLARACIONES
+    struct iomap_writepage_ctx wpc = { };
     
-    // inode_info es la informacion persistente del inodo creado en el paso 2.
-    dir_contents->inode_no = inode_info->inode_no;
+    return iomap_writepages(mapping, wbc, &wpc, &assoofs_writeback_ops);
+}
+
+/******************************* Funcion assoofs_write_failed *******************************/
+//Si una escritura directa que alargaba el fichero falla, quito de la cache y del mapa lo que quede
+//mas alla del tamaño real del fichero
+static void assoofs_write_failed(struct address_space *mapping, loff_t to) {
     
-    strcpy(dir_contents->filename, dentry->d_name.name);
+    //DECLARACIONES
+    struct inode *inode = mapping->host;
+    handle_t *handle;
+    
+    if (to > inode->i_size) {
+        filemap_invalidate_lock(mapping);
+        truncate_pagecache(inode, inode->i_size);
+        
+        handle = assoofs_journal_start(inode->i_sb, ASSOOFS_TRUNCATE_CREDITS, ASSOOFS_REVOKE_CREDITS);
+        if (!IS_ERR(handle)) {
+            down_write(&ASSOOFS_INODE(inode)->i_data_sem);
+            assoofs_truncate_blocks(inode->i_sb, ASSOOFS_I(inode), inode->i_size);
+            assoofs_update_inode(inode);
+            up_write(&ASSOOFS_INODE(inode)->i_data_sem);
+            assoofs_journal_stop(handle);
+        }
+        filemap_invalidate_unlock(mapping);
+    }
+}
+
+//iomap_bmap escribe antes las paginas sucias, para que los bloques diferidos tengan ya numero
+static sector_t assoofs_bmap(struct address_space *mapping, sector_t block) {
+    return iomap_bmap(mapping, block, &assoofs_iomap_ops);
+}
+
+
+/**********************************************************************************************
+ *                               Operaciones sobre directorios                                *
+ **********************************************************************************************/
+
+/******************************* Funcion assoofs_dir_32bit ************************************/
+//Los procesos de 32 bits (y nfsd cuando lo pide) solo pueden guardar cursores de 31 bits
+static bool assoofs_dir_32bit(struct file *filp){
+    
+    if (filp->f_mode & FMODE_32BITHASH)
+        return true;
+    if (filp->f_mode & FMODE_64BITHASH)
+        return false;
+    return in_compat_syscall() || BITS_PER_LONG == 32;
+}
+
+/******************************* Funcion assoofs_dir_cursor ************************************/
+//Cursor de readdir de un nombre: su hash del indice en la parte alta, de modo que los cursores
+//crecen con el orden de las hojas, y un segundo hash en la baja para desempatar los nombres con el
+//mismo hash. Con cursores de 31 bits solo cabe (parte de) el hash del indice
+static loff_t assoofs_dir_cursor(struct file *filp, const char *name, unsigned int len){
+    
+    //DECLARACIONES
+    uint32_t hash = assoofs_dx_hash(name, len);
+    
+    if (assoofs_dir_32bit(filp))
+        return 2 + (hash >> 2);
+    return 2 + (((loff_t)hash << 30) | (jhash(name, len, 0) >> 2));
+}
+
+/******************************* Funcion assoofs_dir_cursor_cmp ********************************/
+static int assoofs_dir_cursor_cmp(const void *a, const void *b){
+    
+    //DECLARACIONES
+    const struct assoofs_dir_cursor *ca = a, *cb = b;
+    
+    return ca->pos < cb->pos ? -1 : ca->pos > cb->pos;
+}
+
+/******************************* Posicionamiento en un directorio ******************************/
+//Los cursores no son desplazamientos en el fichero: pueden llegar hasta el fin del directorio
+static loff_t assoofs_dir_llseek(struct file *file, loff_t offset, int whence){
+    
+    //DECLARACIONES
+    loff_t eof = assoofs_dir_32bit(file) ? ASSOOFS_DIR_EOF_32BIT : ASSOOFS_DIR_EOF_64BIT;
+    
+    return generic_file_llseek_size(file, offset, whence, eof, eof);
+}
+
+/******************************* Funcion assoofs_iterate_leaf **********************************/
+//Emite por orden de cursor las entradas de la hoja lblock cuyo cursor no es menor que ctx->pos.
+//Devuelve 1 si el buffer del usuario se ha llenado (ctx->pos queda en la entrada que no ha cabido)
+static int assoofs_iterate_leaf(struct file *filp, struct dir_context *ctx, uint32_t lblock, struct assoofs_dir_cursor *map){
+    
+    //DECLARACIONES
+    struct inode *inode = file_inode(filp);
+    struct buffer_head *bh;
+    struct assoofs_dir_record_entry *record;
+    unsigned int offset, n = 0, i;
+    loff_t pos;
+    
+    bh = assoofs_dir_bread(inode, lblock);
+    if (!bh)
+        return -EIO;
+    
+    for (offset = 0; offset < ASSOOFS_DEFAULT_BLOCK_SIZE; offset += record->rec_len) {
+        record = assoofs_dir_entry(bh, offset);
+        if (!record) {
+            brelse(bh);
+            return -EIO;
+        }
+        if (!record->inode_no)
+            continue;
+        pos = assoofs_dir_cursor(filp, record->filename, record->name_len);
+        if (pos < ctx->pos)
+            continue;
+        map[n].pos = pos;
+        map[n].offs = offset;
+        n++;
+    }
+    sort(map, n, sizeof(*map), assoofs_dir_cursor_cmp, NULL);
+    
+    for (i = 0; i < n; i++) {
+        record = (struct assoofs_dir_record_entry *)(bh->b_data + map[i].offs);
+        ctx->pos = map[i].pos;
+        if (!dir_emit(ctx, record->filename, record->name_len, record->inode_no, fs_ftype_to_dtype(record->file_type))) {
+            brelse(bh);
+            return 1;
+        }
+    }
     
-    //Marco como sucio
-    mark_buffer_dirty(bh);
-    //Sincronizo
-    sync_dirty_buffer(bh);
     //Libero
     brelse(bh);
+    return 0;
+}
+
+/******************************* Mostrar contenido de directorio ******************************/
+//ctx->pos es un cursor: 0 y 1 son "." y "..", y despues el cursor de cada nombre (assoofs_dir_cursor),
+//que crece con su hash. Las hojas se recorren en el orden del indice, que es el de los hashes, y
+//dentro de cada hoja las entradas se ordenan por cursor. Partir una hoja no cambia el cursor de
+//ningun nombre, asi que un listado que sigue entre dos llamadas no repite ni se salta entradas
+//aunque entretanto se hayan creado otras (y con ellas partido hojas)
+static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
+    
+    //DECLARACIONES
+    struct inode *inode;
+    struct assoofs_inode_info *inode_info;
+    struct assoofs_dx_frame frames[ASSOOFS_DX_MAX_LEVELS];
+    struct assoofs_dx_node *node;
+    struct assoofs_dir_cursor *map;
+    uint32_t levels, hash;
+    loff_t eof = assoofs_dir_32bit(filp) ? ASSOOFS_DIR_EOF_32BIT : ASSOOFS_DIR_EOF_64BIT;
+    int aux;
+    
+    /** 1. Accedo al inodo y a la info persist del inodo correspondientes al arg filp **/
+    inode = file_inode(filp);
+    inode_info = ASSOOFS_I(inode);
+    
+    /** 2. Compruebo que el inodo obtenido en el paso 1 se corresponde con un directorio **/
+    if((!S_ISDIR(inode_info->mode))) return -ENOTDIR;
+    
+    /** 3. Emito "." y ".." **/
+    if (!dir_emit_dots(filp, ctx))
+        return 0;
+    if (ctx->pos >= eof)
+        return 0;
+    
+    /** 4. Bajo por el indice hasta la hoja del hash del cursor **/
+    hash = assoofs_dir_32bit(filp) ? (uint32_t)(ctx->pos - 2) << 2 : (uint32_t)((ctx->pos - 2) >> 30);
+    map = kmalloc_array(ASSOOFS_DIR_MAX_RECORDS, sizeof(*map), GFP_KERNEL);
+    if (!map)
+        return -ENOMEM;
+    aux = assoofs_dx_probe(inode, hash, frames, &levels);
+    if (aux)
+        goto out_map;
+    
+    /** 5. Sigo hoja a hoja hasta que se acaba el indice o se llena el buffer del usuario **/
+    for (;;) {
+        aux = assoofs_iterate_leaf(filp, ctx, frames[levels].at->block, map);
+        if (aux)
+            break;
+        
+        if (++frames[levels].at < frames[levels].entries + *frames[levels].count)
+            continue;
+        //Se acaba el nodo intermedio: paso al siguiente de la raiz
+        if (!levels || ++frames[0].at == frames[0].entries + *frames[0].count) {
+            ctx->pos = eof;
+            break;
+        }
+        brelse(frames[1].bh);
+        frames[1].bh = assoofs_dir_bread(inode, frames[0].at->block);
+        if (!frames[1].bh) {
+            aux = -EIO;
+            break;
+        }
+        node = (struct assoofs_dx_node *)frames[1].bh->b_data;
+        if (!node->count || node->count > ASSOOFS_DX_NODE_LIMIT) {
+            aux = -EIO;
+            break;
+        }
+        frames[1].entries = node->entries;
+        frames[1].count = &node->count;
+        frames[1].at = node->entries;
+    }
+    
+    assoofs_dx_release(frames);
+out_map:
+    kfree(map);
+    return aux < 0 ? aux : 0;
+}
+
+
+/**********************************************************************************************
+ *                                   Operaciones sobre inodos                                 *
+ **********************************************************************************************/
+
+/************************** Creación de nuevos inodos para archivos ****************************/
+static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
+    
+    //DECLARACIONES
+    int aux;
+    uint64_t ino;
+    struct inode *inode;
+    struct assoofs_inode_info *inode_info;
+    struct super_block *sb;
+    handle_t *handle;
+    
+    /** 1. Creo nuevo inodo **/
+    // obtengo un puntero al superbloque desde dir
+    sb = dir->i_sb;
+    
+    //Abro la transaccion: el mapa de bits, la tabla de inodos, el superbloque y el directorio padre
+    //se confirman juntos en el journal, o no se confirma nada
+    handle = assoofs_journal_start(sb, ASSOOFS_CREATE_CREDITS, ASSOOFS_REVOKE_CREDITS);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+    
+    //El VFS solo bloquea el directorio padre: el numero de inodo se reserva aparte
+    aux = assoofs_new_inode_no(sb, &ino);
+    if (aux) {
+        assoofs_journal_stop(handle);
+        return aux;
+    }
+    
+    //Nuevo inodo
+    inode = new_inode(sb);
+    if (!inode) {
+        assoofs_release_inode_no(sb, ino);
+        assoofs_journal_stop(handle);
+        return -ENOMEM;
+    }
+    
+    //Propietario y modo antes que nada: inode_init_owner calcula el i_mode final (el bit SGID
+    //depende del directorio padre) y es el que llega al registro y a la entrada del directorio
+    inode_init_owner(mnt_userns, inode, dir, mode);
+    
+    // Asigno al nuevo inodo el numero reservado
+    inode->i_ino = ino;
+        
+    //Guardo el superbloque en el inodo
+    inode->i_sb = sb;
+    
+    inode->i_op = &assoofs_inode_ops;
+            
+    // fechas.
+	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);      
+    
+    inode_info = ASSOOFS_I(inode);
     
-    /** 3. Actualizo la info del inodo padre, indicandole que tiene 1 archivo nuevo **/
-    parent_inode_info->dir_children_count++;
+    inode_info->mode = inode->i_mode;
     
-    //Funcion auxiliar para actualizar la info
-    assoofs_save_inode_info(sb, parent_inode_info);
+    inode_info->inode_no = inode->i_ino; /** hhhhhh **/
+    
+    inode_info->file_size = 0;
+    
+    //Para las operaciones sobre ficheros
+    inode->i_fop = &assoofs_file_operations;
+    inode->i_mapping->a_ops = &assoofs_aops;
+    mapping_set_large_folios(inode->i_mapping);
+    
+    //El fichero nace sin bloques y con el contenido inline; si crece por encima del registro
+    //los bloques se le asignan en el writeback
+    inode_info->extents_count = 0;
+    inode_info->extent_block = 0;
+    inode_info->flags = ASSOOFS_INODE_INLINE_DATA;
+    
+    /** 2. Anado la entrada al indice del directorio padre (actualiza su dir_children_count) **/
+    aux = assoofs_dx_add_entry(dir, dentry->d_name.name, dentry->d_name.len, inode_info->inode_no, inode_info->mode);
+    if(aux){
+        assoofs_truncate_blocks(sb, inode_info, 0);
+        iput(inode);
+        assoofs_release_inode_no(sb, ino);
+        assoofs_journal_stop(handle);
+        return aux;
+    }
+    
+    //El registro del padre va en la misma transaccion que su entrada nueva
+    assoofs_update_inode(dir);
+    
+    /** 3. Guardo el nuevo inodo **/
+    //Lo añado a la tabla hash de inodos para que el writeback lo tenga en cuenta
+    insert_inode_hash(inode);
+    
+    //Funcion auxiliar para guardar la informacion persistente del nuevo inodo en disco
+    assoofs_add_inode_info(sb, inode_info);
     
-    inode_init_owner(inode, dir, mode);
     d_add(dentry, inode);
- 
-    printk(KERN_INFO "********** Fin llamada a Create **********\n");
+    
+    assoofs_journal_stop(handle);
     
     return 0;
 }
 
 /******************************* Creacion de directorios MKDIR *******************************/
-static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode) {
+static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir , struct dentry *dentry, umode_t mode) {
 
     //DECLARACIONES
  	int aux;
-   	uint64_t count;
+   	uint64_t ino;
     struct inode *inode;
     struct assoofs_inode_info *inode_info;
-    struct assoofs_inode_info *parent_inode_info;
-    struct assoofs_dir_record_entry *dir_contents;
     struct super_block *sb; 
-    struct buffer_head *bh; 
+    handle_t *handle;
         
-    printk(KERN_INFO "\n********** Llamada a Mkdir **********\n");
-    
     /** 1. Creo nuevo inodo **/
     // obtengo un puntero al superbloque desde dir
     sb = dir->i_sb;
     
-    // obtengo el número de inodos de la informacion persistente del superbloque
-    count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count;
-    
-    //Compruebo que el valor de count no es superior al numero maximo de objetos soportados
-    if(count >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
-        printk(KERN_ERR"ERROR, El archivo esta completo.\n" );
-        return -12;
+    //Abro la transaccion: el mapa de bits, la tabla de inodos, el superbloque y el directorio padre
+    //se confirman juntos en el journal, o no se confirma nada
+    handle = assoofs_journal_start(sb, ASSOOFS_CREATE_CREDITS, ASSOOFS_REVOKE_CREDITS);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+    
+    //El VFS solo bloquea el directorio padre: el numero de inodo se reserva aparte
+    aux = assoofs_new_inode_no(sb, &ino);
+    if (aux) {
+        assoofs_journal_stop(handle);
+        return aux;
     }
     
     //Nuevo inodo
     inode = new_inode(sb);
+    if (!inode) {
+        assoofs_release_inode_no(sb, ino);
+        assoofs_journal_stop(handle);
+        return -ENOMEM;
+    }
+    
+    //Propietario y modo antes que nada, igual que en assoofs_create
+    inode_init_owner(mnt_userns, inode, dir, S_IFDIR | mode);
     
-    // Asigno numero al nuevo inodo a partir de count
-    inode->i_ino = (count + ASSOOFS_START_INO - ASSOOFS_RESERVED_INODES + 1);
+    // Asigno al nuevo inodo el numero reservado
+    inode->i_ino = ino;
     
     //Guardo el superbloque en el inodo
     inode->i_sb = sb;
@@ -412,66 +1489,157 @@ static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode
     // fechas.
     inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
     
-    inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
+    inode_info = ASSOOFS_I(inode);
     
-    // El segundo mode me llega como argumento
-    inode_info->mode = S_IFDIR | mode;
+    inode_info->mode = inode->i_mode;
     inode_info->inode_no = inode->i_ino; /** hhhhhh **/
 
-    printk(KERN_INFO "      MKDIR - Solicitud de creación de nuevo directorio %s.", dentry -> d_name.name);
-    
 	//Para las operaciones sobre directorios
 	inode_info->dir_children_count = 0;
     inode->i_fop = &assoofs_dir_operations;
 
-    //Funcion auxiliar para asignarle un bloque al nuevo inodo
-    aux = assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number);
+    //Funcion auxiliar que crea el indice del directorio vacio (raiz del indice y una hoja)
+    aux = assoofs_dx_init(inode);
     
     //Control de errores
     if(aux < 0){
-        printk(KERN_ERR "Simplefs no tiene un bloque libre.\n");
-        return -1;
+        printk(KERN_ERR "ASSOOFS: no se puede crear el indice del directorio (%d).\n", aux);
+        assoofs_truncate_blocks(sb, inode_info, 0);
+        iput(inode);
+        assoofs_release_inode_no(sb, ino);
+        assoofs_journal_stop(handle);
+        return aux;
     }
     
-    //Incluimos campo i_private
-    inode->i_private = inode_info;
+    /** 2. Anado la entrada al indice del directorio padre (actualiza su dir_children_count) **/
+    aux = assoofs_dx_add_entry(dir, dentry->d_name.name, dentry->d_name.len, inode_info->inode_no, inode_info->mode);
+    if(aux){
+        assoofs_truncate_blocks(sb, inode_info, 0);
+        iput(inode);
+        assoofs_release_inode_no(sb, ino);
+        assoofs_journal_stop(handle);
+        return aux;
+    }
+    
+    //El registro del padre va en la misma transaccion que su entrada nueva
+    assoofs_update_inode(dir);
+    
+    /** 3. Guardo el nuevo inodo **/
+    //Lo añado a la tabla hash de inodos para que el writeback lo tenga en cuenta
+    insert_inode_hash(inode);
     
     //Funcion auxiliar para guardar la informacion persistente del nuevo inodo en disco
     assoofs_add_inode_info(sb, inode_info);
     
-    /** 2. Modifico el contenido del directorio padre **/
-    parent_inode_info = dir->i_private;
+    d_add(dentry, inode);
     
-    bh = sb_bread(sb, parent_inode_info->data_block_number);
+    assoofs_journal_stop(handle);
     
-    dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
-    dir_contents += parent_inode_info->dir_children_count;
+    return 0;
+}
+
+/******************************* Cambio de tamaño *******************************/
+//Recorta o alarga el fichero: pone a cero el final del ultimo bloque, quita de la cache las paginas
+//sobrantes y libera sus bloques. Se llama con i_rwsem y el invalidate_lock del mapping cogidos: las
+//lecturas (readahead, fallos de pagina) no pueden mapear entretanto un bloque que se va a liberar
+static int assoofs_setsize(struct inode *inode, loff_t size) {
     
-    // inode_info es la informacion persistente del inodo creado en el paso 2.
-    dir_contents->inode_no = inode_info->inode_no;
+    //DECLARACIONES
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    uint32_t first = DIV_ROUND_UP(size, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    handle_t *handle;
+    int aux;
     
-    strcpy(dir_contents->filename, dentry->d_name.name);
+    //Un fichero inline que pasa del limite del registro necesita ya su bloque
+    if (assoofs_has_inline_data(inode) && size > ASSOOFS_INLINE_DATA_MAX) {
+        aux = assoofs_inline_convert(inode);
+        if (aux)
+            return aux;
+    }
     
-    //Marco como sucio
-    mark_buffer_dirty(bh);
-    //Sincronizo
-    sync_dirty_buffer(bh);
-    //Libero
-    brelse(bh);
+    if (assoofs_has_inline_data(inode)) {
+        //Solo hay que borrar del registro lo que queda por encima del nuevo tamaño
+        truncate_setsize(inode, size);
+        if (size < ASSOOFS_INLINE_DATA_MAX)
+            memset(inode_info->inline_data + size, 0, ASSOOFS_INLINE_DATA_MAX - size);
+        
+        handle = assoofs_journal_start(inode->i_sb, ASSOOFS_INODE_CREDITS, 0);
+        if (IS_ERR(handle))
+            return PTR_ERR(handle);
+        aux = assoofs_update_inode(inode);
+        assoofs_journal_stop(handle);
+        return aux;
+    }
     
-    /** 3. Actualizo la info del inodo padre, indicandole que tiene 1 archivo nuevo **/
-    parent_inode_info->dir_children_count++;
+    //Pongo a cero el final del ultimo bloque que se queda en el fichero
+    aux = iomap_truncate_page(inode, size, NULL, &assoofs_iomap_ops);
+    if (aux)
+        return aux;
+    
+    //Los bloques diferidos de las paginas quitadas de la cache ya no se van a escribir
+    truncate_setsize(inode, size);
+    assoofs_da_punch(inode, first, (1ULL << 32) - first);
+    
+    //Los bloques liberados y el registro con el nuevo tamaño van en la misma transaccion
+    handle = assoofs_journal_start(inode->i_sb, ASSOOFS_TRUNCATE_CREDITS, ASSOOFS_REVOKE_CREDITS);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+    
+    down_write(&ASSOOFS_INODE(inode)->i_data_sem);
+    aux = assoofs_truncate_blocks(inode->i_sb, inode_info, size);
+    if (!aux)
+        aux = assoofs_update_inode(inode);
+    up_write(&ASSOOFS_INODE(inode)->i_data_sem);
+    assoofs_journal_stop(handle);
+    return aux;
+}
+
+/******************************* Cambio de atributos (truncate) *******************************/
+static int assoofs_setattr(struct user_namespace *mnt_userns, struct dentry *dentry, struct iattr *attr) {
     
-    //Funcion auxiliar para actualizar la info
-    assoofs_save_inode_info(sb, parent_inode_info);
+    //DECLARACIONES
+    struct inode *inode = d_inode(dentry);
+    int aux;
     
-    inode_init_owner(inode, dir, inode_info->mode);
-    d_add(dentry, inode);
+    aux = setattr_prepare(mnt_userns, dentry, attr);
+    if (aux)
+        return aux;
+    
+    /** Cambio de tamaño: recorto la cache de paginas y libero los bloques sobrantes **/
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)) {
+        if (!S_ISREG(inode->i_mode))
+            return -EINVAL;
+        
+        //Espero a que acaben las escrituras directas asincronas sobre los bloques que voy a liberar
+        inode_dio_wait(inode);
+        
+        filemap_invalidate_lock(inode->i_mapping);
+        aux = assoofs_setsize(inode, attr->ia_size);
+        filemap_invalidate_unlock(inode->i_mapping);
+        if (aux)
+            return aux;
+    }
+    
+    setattr_copy(mnt_userns, inode, attr);
+    mark_inode_dirty(inode);
     
-    printk(KERN_INFO "********** Fin llamada a Mkdir **********\n");
     return 0;
 }
 
+/******************************* Mapa de bloques (FIEMAP) *******************************/
+static int assoofs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len) {
+    
+    //DECLARACIONES
+    int aux;
+    
+    //Los bloques diferidos aun no estan en el mapa de extents
+    aux = filemap_write_and_wait(inode->i_mapping);
+    if (aux)
+        return aux;
+    
+    return iomap_fiemap(inode, fieinfo, start, len, &assoofs_iomap_ops);
+}
+
 
 /**********************************************************************************************
  *                               Operaciones sobre el superbloque                             *
@@ -483,117 +1651,463 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
     //DECLARACIONES
     struct buffer_head *bh;
     struct assoofs_super_block_info *assoofs_sb;
+    struct assoofs_sb_info *sbi;
     struct inode *root_inode; //Declaro nuevo inodo
-    
-    printk(KERN_INFO "--------------------------------------------------");
-    printk(KERN_INFO "assoofs_fill_super Solicitado\n");
+    int aux;
     
     /** 1.- Leo la información persistente del superbloque del dispositivo de bloques **/
     //La funcion assoofs_fill_super recibe el argumento sb ** ANEXO C **
+    //Trabajo siempre con bloques de ASSOOFS_DEFAULT_BLOCK_SIZE bytes
+    if(!sb_set_blocksize(sb, ASSOOFS_DEFAULT_BLOCK_SIZE)){
+        printk(KERN_ERR "ERROR, El dispositivo no admite bloques de %d bytes.\n", ASSOOFS_DEFAULT_BLOCK_SIZE);
+        return -EINVAL;
+    }
+    
     bh = sb_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
+    if(!bh){
+        printk(KERN_ERR "ERROR, No se puede leer el superbloque.\n");
+        return -EIO;
+    }
     
     assoofs_sb = (struct assoofs_super_block_info *)bh->b_data;
  
     /** 2.- Compruebo los parámetros del superbloque **/
     if(assoofs_sb->magic != ASSOOFS_MAGIC){
         printk(KERN_ERR "ERROR, El sistema de archivos que quieres montar no es de tipo ASSOOFS.\n" );
-        //Libero Recursos
-        brelse(bh);
-        return -1;
+        aux = -EINVAL;
+        goto out_bh;
     }
-    else{
-        printk(KERN_INFO "Numero magico correcto. El numero magico es %llu.\n", assoofs_sb->magic);
+    
+    if(assoofs_sb->version != ASSOOFS_VERSION){
+        printk(KERN_ERR "ERROR, Version de ASSOOFS %llu no soportada (se esperaba %d).\n", assoofs_sb->version, ASSOOFS_VERSION);
+        aux = -EINVAL;
+        goto out_bh;
+    }
+    
+    if(!assoofs_sb->inode_table_block || !assoofs_sb->inode_table_blocks){
+        printk(KERN_ERR "ERROR, ASSOOFS sin tabla de inodos.\n");
+        aux = -EINVAL;
+        goto out_bh;
+    }
+    
+    if(assoofs_sb->blocks_count > sb_bdev_nr_blocks(sb) || !assoofs_sb->bitmap_block ||
+       assoofs_sb->bitmap_blocks < DIV_ROUND_UP(assoofs_sb->blocks_count, ASSOOFS_BLOCKS_PER_GROUP)){
+        printk(KERN_ERR "ERROR, El mapa de bits de ASSOOFS no corresponde con el dispositivo.\n");
+        aux = -EINVAL;
+        goto out_bh;
+    }
+    
+    if(assoofs_sb->journal_blocks && (assoofs_sb->journal_blocks < ASSOOFS_MIN_JOURNAL_BLOCKS ||
+       assoofs_sb->journal_block + assoofs_sb->journal_blocks > assoofs_sb->blocks_count)){
+        printk(KERN_ERR "ERROR, El journal de ASSOOFS no cabe en el dispositivo.\n");
+        aux = -EINVAL;
+        goto out_bh;
     }
     
     if(assoofs_sb->block_size != ASSOOFS_DEFAULT_BLOCK_SIZE){
         printk(KERN_ERR"ERROR, ASSOOFS formateado con tamaño de bloque erroneo.\n" );
-        //Libero Recursos
-        brelse(bh);
-        return -1;
-    }
-    else{
-        printk(KERN_INFO "El Sistema de Archivos ASSOOFS version %llu formateado con un tamaño de bloque correcto. El tamaño de bloque es %llu.\n", assoofs_sb->version, assoofs_sb->block_size);
+        aux = -EINVAL;
+        goto out_bh;
     }
     
     /** 3.- Escribo la info persist leída del dispos de bloq en el superbloq sb, incluído el campo s_op con ops soportadas **/  
+    //Para evitar acceder al bloque 0 constantemente, retengo su buffer en la info en memoria del superbloque
+    sbi = kzalloc(sizeof(struct assoofs_sb_info), GFP_KERNEL);
+    if(!sbi){
+        aux = -ENOMEM;
+        goto out_bh;
+    }
+    sbi->s_asb = assoofs_sb;
+    sbi->s_sbh = bh;
+    sbi->s_sb = sb;
+    sbi->s_commit_interval = ASSOOFS_DEFAULT_COMMIT_INTERVAL;
+    INIT_DELAYED_WORK(&sbi->s_commit_work, assoofs_commit_work);
+    spin_lock_init(&sbi->s_inode_lock);
+    bgl_lock_init(&sbi->s_blockgroup_lock);
+    
+    sbi->s_stats = alloc_percpu(struct assoofs_stats);
+    if(!sbi->s_stats){
+        aux = -ENOMEM;
+        goto out_sbi;
+    }
+    
+    aux = assoofs_parse_options(data, sbi);
+    if(aux){
+        printk(KERN_ERR "ERROR, Opciones de montaje no validas.\n");
+        goto out_stats;
+    }
+    
     //Asigno el numero magico al superbloque recibido por parametro  
     sb->s_magic = ASSOOFS_MAGIC; 
-    sb->s_maxbytes = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    sb->s_maxbytes = (loff_t)U32_MAX * ASSOOFS_DEFAULT_BLOCK_SIZE;
     sb->s_op = &assoofs_sops;
-    //Para evitar acceder al bloque 0 constantemente, guardo la info leida en el parametro s_fs_info
-    sb->s_fs_info = assoofs_sb;
+    sb->s_fs_info = sbi;
+    
+    //Abro el journal antes de leer ningun otro metadato: si el sistema no se desmonto bien, al
+    //cargarlo se rehacen las transacciones confirmadas que no llegaron a su sitio
+    aux = assoofs_journal_load(sb);
+    if(aux){
+        printk(KERN_ERR "ERROR, No se puede cargar el journal de metadatos.\n");
+        goto out_stats;
+    }
+    
+    //Cuento los bloques libres de cada grupo para no recorrer los grupos llenos al reservar
+    aux = assoofs_load_group_counts(sb);
+    if(aux){
+        printk(KERN_ERR "ERROR, No se puede leer el mapa de bits de bloques.\n");
+        goto out_groups;
+    }
     
     /** 4.- Creo el inodo raíz y le asigno operaciones sobre inodos (i_op) y sobre dir (i_fop) **/
     
+    //El inodo raiz y los primeros inodos estan al principio de la tabla
+    assoofs_mount_readahead(sb, sbi->s_asb->inode_table_block, sbi->s_asb->inode_table_blocks);
+    
     /** Creo inodos ANEXO E **/
     
     //Creo nuevo inodo
-    root_inode = new_inode(sb);
-    
-    //Lo inicializo
-    inode_init_owner(root_inode, NULL, S_IFDIR);
-    
-    // numero de inodo
-    root_inode->i_ino = ASSOOFS_ROOTDIR_INODE_NUMBER;
-    // puntero al superbloque
-    root_inode->i_sb = sb;
-    // direccion de una variable de tipo struct inode_operations previamente declarada
-    root_inode->i_op = &assoofs_inode_ops;
-    // direccion de una variable de tipo struct dir_operations previamente declarada
-    root_inode->i_fop = &assoofs_dir_operations;
-    // fechas.
-    root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime = current_time(root_inode);
+    //Lo obtengo de la tabla de inodos como cualquier otro; queda en la cache de inodos del VFS
+    root_inode = assoofs_get_inode(sb, ASSOOFS_ROOTDIR_INODE_NUMBER);
+    if(IS_ERR(root_inode)){
+        printk(KERN_ERR "ERROR, No se puede leer el inodo raiz.\n");
+        aux = PTR_ERR(root_inode);
+        goto out_groups;
+    }
     
-    // Informacion persistente del inodo
-    root_inode->i_private = assoofs_get_inode_info(sb, ASSOOFS_ROOTDIR_INODE_NUMBER);
+    //Lo primero que se hace tras montar es leer la raiz: pido ya su primer tramo
+    if (ASSOOFS_I(root_inode)->extents_count)
+        assoofs_mount_readahead(sb, ASSOOFS_I(root_inode)->extents[0].ee_start, ASSOOFS_I(root_inode)->extents[0].ee_len);
     
     //Introduzco el nuevo inodo del arbol //el nuevo inodo es inodo raiz
     sb->s_root = d_make_root(root_inode);
 
-   	//Si sb no entra en el inodo, devuelvo error, libero la memoria y return 
+   	//Si sb no entra en el inodo, devuelvo error, libero la memoria y return (d_make_root ya ha
+   	//soltado el inodo)
    	if(!sb->s_root){
-   		return -12;
+   		aux = -ENOMEM;
+   		goto out_groups;
    	}
-    printk(KERN_INFO "assoofs_fill_super Completado Satisfactoriamente\n");
-    printk(KERN_INFO "--------------------------------------------------");
-   
+    
+    //Estadisticas en /sys/fs/assoofs/<dispositivo>
+    aux = assoofs_sysfs_register(sb);
+    if(aux){
+        printk(KERN_ERR "ERROR, No se puede crear el directorio de estadisticas en sysfs.\n");
+        goto out_root;
+    }
+    
+    //Un montaje de solo lectura no escribe el superbloque
+    if(!sb_rdonly(sb)){
+        aux = assoofs_mark_fs_dirty(sb);
+        if(aux){
+            printk(KERN_ERR "ERROR, No se puede escribir el superbloque.\n");
+            goto out_sysfs;
+        }
+    }
+    
+    //Arranco el volcado periodico de los metadatos sucios
+    schedule_delayed_work(&sbi->s_commit_work, sbi->s_commit_interval * HZ);
+
    	return 0;
+    
+    //Libero Recursos, en orden inverso al que se han ido cogiendo
+out_sysfs:
+    assoofs_sysfs_unregister(sb);
+out_root:
+    dput(sb->s_root);
+    sb->s_root = NULL;
+out_groups:
+    assoofs_destroy_group_counts(sbi);
+    assoofs_journal_destroy(sb);
+out_stats:
+    sb->s_fs_info = NULL;
+    free_percpu(sbi->s_stats);
+out_sbi:
+    kfree(sbi);
+out_bh:
+    brelse(bh);
+    return aux;
 }
 
-
-/**********************************************************************************************
- *                                   Funciones Auxiliares                                      *
- **********************************************************************************************/
-
+/***************************** Reserva de un inodo *****************************/
+static struct inode *assoofs_alloc_inode(struct super_block *sb) {
+    
+    //DECLARACIONES
+    struct assoofs_inode *ai;
+    
+    ai = alloc_inode_sb(sb, assoofs_inode_cache, GFP_KERNEL);
+    if (!ai)
+        return NULL;
+    
+    memset(&ai->info, 0, sizeof(ai->info));
+    ai->i_reserved = 0;
+    ai->i_delalloc = RB_ROOT;
+    return &ai->vfs_inode;
+}
+
+/***************************** Liberacion de un inodo *****************************/
+static void assoofs_free_inode(struct inode *inode) {
+    
+    kmem_cache_free(assoofs_inode_cache, container_of(inode, struct assoofs_inode, vfs_inode));
+}
+
+/***************************** Descarte de un inodo *****************************/
+//Las paginas sucias que se tiran con el inodo ya no se van a escribir: devuelvo sus reservas
+static void assoofs_evict_inode(struct inode *inode) {
+    
+    truncate_inode_pages_final(&inode->i_data);
+    assoofs_da_punch(inode, 0, 1ULL << 32);
+    clear_inode(inode);
+}
+
+/***************************** Escritura de un inodo sucio *****************************/
+//La llama el writeback (o fsync/sync) para llevar al almacen de inodos un inodo marcado como sucio
+static int assoofs_write_inode(struct inode *inode, struct writeback_control *wbc) {
+    
+    //DECLARACIONES
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    struct assoofs_inode_info *record;
+    struct buffer_head *bh;
+    handle_t *handle;
+    int aux;
+    
+    //El mapa de extents del registro lo cambian el writeback y las escrituras directas con i_data_sem
+    //exclusivo: lo copio con i_data_sem compartido para no guardar un mapa a medias.
+    //Con journal el registro entra en la transaccion en curso; quien necesita que llegue a disco
+    //fuerza el commit (assoofs_fsync, assoofs_sync_fs)
+    if (ASSOOFS_SB(sb)->s_journal) {
+        handle = assoofs_journal_start(sb, ASSOOFS_INODE_CREDITS, 0);
+        if (IS_ERR(handle))
+            return PTR_ERR(handle);
+        down_read(&ASSOOFS_INODE(inode)->i_data_sem);
+        aux = assoofs_update_inode(inode);
+        up_read(&ASSOOFS_INODE(inode)->i_data_sem);
+        assoofs_journal_stop(handle);
+        return aux;
+    }
+    
+    down_read(&ASSOOFS_INODE(inode)->i_data_sem);
+    aux = assoofs_update_inode(inode);
+    up_read(&ASSOOFS_INODE(inode)->i_data_sem);
+    
+    //En una sincronizacion (fsync, sync, desmontaje) espero a que el registro llegue a disco
+    if (!aux && wbc->sync_mode == WB_SYNC_ALL) {
+        bh = assoofs_read_inode_block(sb, inode_info->inode_no, &record);
+        if (!bh)
+            return -EIO;
+        aux = assoofs_sync_buffer(sb, bh);
+        brelse(bh);
+    }
+    
+    return aux;
+}
+
+/***************************** Sincronizacion del superbloque *****************************/
+static int assoofs_sync_fs(struct super_block *sb, int wait) {
+    
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    tid_t target;
+    
+    //Con journal confirmo la transaccion en curso, que lleva todos los metadatos modificados hasta ahora
+    if (sbi->s_journal) {
+        if (jbd2_journal_start_commit(sbi->s_journal, &target) && wait)
+            return jbd2_log_wait_commit(sbi->s_journal, target);
+        return 0;
+    }
+    
+    //El resto de bloques de metadatos sucios los escribe sync_blockdev despues de esta llamada
+    if (wait)
+        return assoofs_sync_buffer(sb, sbi->s_sbh);
+    
+    return 0;
+}
+
+/***************************** Volcado periodico (commit=) *****************************/
+static void assoofs_commit_work(struct work_struct *work) {
+    
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = container_of(to_delayed_work(work), struct assoofs_sb_info, s_commit_work);
+    struct super_block *sb = sbi->s_sb;
+    
+    //Si no consigo el cerrojo es que se esta desmontando (o remontando), que ya sincroniza
+    if (down_read_trylock(&sb->s_umount)) {
+        sync_filesystem(sb);
+        up_read(&sb->s_umount);
+    }
+    
+    schedule_delayed_work(&sbi->s_commit_work, sbi->s_commit_interval * HZ);
+}
+
+/***************************** Desmontaje *****************************/
+static void assoofs_put_super(struct super_block *sb) {
+    
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    
+    cancel_delayed_work_sync(&sbi->s_commit_work);
+    assoofs_sysfs_unregister(sb);
+    
+    //Al cerrar el journal se confirma lo pendiente y los bloques se escriben en su sitio
+    assoofs_journal_destroy(sb);
+    
+    //En solo lectura el superbloque ya quedo limpio al montar o al remontar
+    if (!sb_rdonly(sb))
+        assoofs_mark_fs_clean(sb);
+    
+    //Los metadatos ya se han sincronizado antes de llegar aqui; suelto el bloque 0
+    brelse(sbi->s_sbh);
+    sb->s_fs_info = NULL;
+    assoofs_destroy_group_counts(sbi);
+    free_percpu(sbi->s_stats);
+    kfree(sbi);
+}
+
+/***************************** Remontaje *****************************/
+//mount -o remount: cambia commit= y pasa de lectura/escritura a solo lectura o al reves. Al pasar a
+//solo lectura vacio el journal y dejo el superbloque limpio, como al desmontar; al volver a
+//lectura/escritura borro la marca antes de la primera escritura
+static int assoofs_remount(struct super_block *sb, int *flags, char *data) {
+    
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    unsigned int commit_interval = sbi->s_commit_interval;
+    int aux;
+    
+    sync_filesystem(sb);
+    
+    aux = assoofs_parse_options(data, sbi);
+    if (aux) {
+        sbi->s_commit_interval = commit_interval;
+        return aux;
+    }
+    if (sbi->s_journal) {
+        write_lock(&sbi->s_journal->j_state_lock);
+        sbi->s_journal->j_commit_interval = sbi->s_commit_interval * HZ;
+        write_unlock(&sbi->s_journal->j_state_lock);
+    }
+    
+    if (!(*flags & SB_RDONLY) == !sb_rdonly(sb))
+        return 0;
+    
+    if (!(*flags & SB_RDONLY))
+        return assoofs_mark_fs_dirty(sb);
+    
+    if (sbi->s_journal) {
+        aux = jbd2_journal_flush(sbi->s_journal, 0);
+        if (aux)
+            return aux;
+    }
+    return assoofs_mark_fs_clean(sb);
+}
+
+/***************************** Espacio libre (df) *****************************/
+//Solo lee los contadores por CPU: no coge cerrojos del asignador ni recorre el mapa de bits
+static int assoofs_statfs(struct dentry *dentry, struct kstatfs *buf) {
+    
+    //DECLARACIONES
+    struct super_block *sb = dentry->d_sb;
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    s64 bfree, reserved;
+    
+    bfree = percpu_counter_read_positive(&sbi->s_freeblocks_counter) - percpu_counter_read_positive(&sbi->s_dirtyblocks_counter);
+    if (bfree < 0)
+        bfree = 0;
+    
+    buf->f_type = ASSOOFS_MAGIC;
+    buf->f_bsize = sb->s_blocksize;
+    buf->f_blocks = sbi->s_asb->blocks_count;
+    buf->f_bfree = bfree;
+    //Las escrituras diferidas no pueden gastar el margen reservado para los bloques de extents, y los
+    //usuarios normales tampoco los bloques reservados con mkassoofs -m
+    reserved = ASSOOFS_DA_META_RESERVE + sbi->s_asb->reserved_blocks;
+    buf->f_bavail = bfree > reserved ? bfree - reserved : 0;
+    buf->f_files = sbi->s_asb->inode_table_blocks * ASSOOFS_INODES_PER_BLOCK;
+    buf->f_ffree = percpu_counter_read_positive(&sbi->s_freeinodes_counter);
+    buf->f_namelen = ASSOOFS_FILENAME_MAXLEN;
+    buf->f_fsid = u64_to_fsid(huge_encode_dev(sb->s_bdev->bd_dev));
+    return 0;
+}
+
+/***************************** Opciones de montaje *****************************/
+static int assoofs_show_options(struct seq_file *seq, struct dentry *root) {
+    
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(root->d_sb);
+    
+    if (sbi->s_commit_interval != ASSOOFS_DEFAULT_COMMIT_INTERVAL)
+        seq_printf(seq, ",commit=%u", sbi->s_commit_interval);
+    
+    return 0;
+}
+
+
+/**********************************************************************************************
+ *                                   Funciones Auxiliares                                      *
+ **********************************************************************************************/
+
 /******************************* Funcion assoofs_get_inode_info ********************************/
-//Funcion auxiliar que me permite obtener la informacion persistente del inodo numero inode_no del superbloque sb
-struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no){
+//Funcion auxiliar que copia en inode_info la informacion persistente del inodo numero inode_no del superbloque sb
+int assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info *inode_info){
     
     //DECLARACIONES
-    struct assoofs_inode_info *inode_info = NULL;
+    struct assoofs_inode_info *record;
     struct buffer_head *bh;
-    struct assoofs_super_block_info *afs_sb = sb->s_fs_info;
-    struct assoofs_inode_info *buffer = NULL;
-    int i;
+    int aux = -ESTALE;
     
-    /** 1. Accedo al disco para leer el bloque que contiene el almacen de inodos **/
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-    inode_info = (struct assoofs_inode_info *)bh->b_data;
+    /** 1. Accedo al disco para leer el bloque de la tabla de inodos que contiene el inodo inode_no **/
+    bh = assoofs_read_inode_block(sb, inode_no, &record);
+    if (!bh) {
+        trace_assoofs_get_inode_info(sb, inode_no, -EIO);
+        return -EIO;
+    }
     
-    /** 2. Recorro el almacen de inodos en busca del inodo inode_no **/
-    for (i = 0; i < afs_sb->inodes_count; i++) {
-        if (inode_info->inode_no == inode_no) {
-            buffer = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-            memcpy(buffer, inode_info, sizeof(*buffer));
-            break;
-        }
-        inode_info++;
+    /** 2. Compruebo que el registro esta en uso **/
+    if (record->inode_no == inode_no) {
+        memcpy(inode_info, record, sizeof(*inode_info));
+        aux = 0;
     }
     
-    /** 3. Libero recursos y devuelvo la informacion del inodo inode_no si estaba en el almacen **/
+    /** 3. Libero recursos **/
     brelse(bh);
     
-    return buffer;
+    trace_assoofs_get_inode_info(sb, inode_no, aux);
+    return aux;
+}
+
+/******************************* Funcion assoofs_update_inode ************************************/
+//Copia en la tabla de inodos el registro del inodo en memoria, con el tamaño actual si es un fichero
+int assoofs_update_inode(struct inode *inode){
+    
+    //DECLARACIONES
+    struct assoofs_inode_info *inode_info = ASSOOFS_I(inode);
+    
+    if (S_ISREG(inode->i_mode))
+        inode_info->file_size = i_size_read(inode);
+    
+    return assoofs_save_inode_info(inode->i_sb, inode_info);
+}
+
+/******************************* Funcion assoofs_read_inode_block ********************************/
+//Lee el bloque de la tabla de inodos que contiene el registro del inodo inode_no y deja en record
+//un puntero a ese registro. La posicion se calcula con el numero de inodo, sin recorrer la tabla
+struct buffer_head *assoofs_read_inode_block(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info **record){
+    
+    //DECLARACIONES
+    struct assoofs_super_block_info *afs_sb = ASSOOFS_SB(sb)->s_asb;
+    struct buffer_head *bh;
+    
+    if (inode_no >= afs_sb->inode_table_blocks * ASSOOFS_INODES_PER_BLOCK) {
+        printk(KERN_ERR "El inodo %llu esta fuera de la tabla de inodos.\n", inode_no);
+        return NULL;
+    }
+    
+    bh = assoofs_bread(sb, ASSOOFS_INODE_BLOCK(afs_sb, inode_no));
+    if (!bh)
+        return NULL;
+    
+    *record = (struct assoofs_inode_info *)bh->b_data + ASSOOFS_INODE_OFFSET(inode_no);
+    return bh;
 }
 
 /******************************* Funcion Look_up (2.3.4) *******************************/
@@ -602,240 +2116,2139 @@ struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64
 struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags) {
     
     //DECLARACIONES
-    struct assoofs_inode_info *parent_info = parent_inode->i_private;
     struct super_block *sb = parent_inode->i_sb;
-    struct buffer_head *bh;
-    struct assoofs_dir_record_entry *record;
-    int i;
-    
-    printk(KERN_INFO "\n********** Llamada a Lookup **********\n");
-    
-    /** 1. Accedo al bloque de disco apuntado por parent inode **/
-    bh = sb_bread(sb, parent_info->data_block_number);
+    struct inode *inode;
+    uint64_t ino;
+    int aux;
     
-    /** 2. Recorro el contenido del dir buscando la entrada (el nombre corresponde con buscado) **/  
-    record = (struct assoofs_dir_record_entry *)bh->b_data;
+    if (child_dentry->d_name.len > ASSOOFS_FILENAME_MAXLEN)
+        return ERR_PTR(-ENAMETOOLONG);
     
-    for (i = 0; i < parent_info->dir_children_count; i++) {
-        //Si localizo la entrada, entonces tengo que construir el inodo correspondiente.
-        if (!strcmp(record->filename, child_dentry->d_name.name)) {
-            // Funcion auxiliar que obtiene la info de un inodo a partir de su numero de inodo.
-            struct inode *inode = assoofs_get_inode(sb, record->inode_no);
-            inode_init_owner(inode, parent_inode, ((struct assoofs_inode_info *)inode->i_private)->mode);
-            d_add(child_dentry, inode);
-            //Libero
-            brelse(bh);
-            printk(KERN_INFO "      LOOKUP - Archivo encontrado %s.\n", record->filename);
-            return NULL;
-        }
-        record++;
+    /** 1. Busco el nombre en el indice del directorio padre: solo leo la hoja que le corresponde por hash **/
+    aux = assoofs_dx_find_entry(parent_inode, child_dentry->d_name.name, child_dentry->d_name.len, &ino);
+    if (aux == -ENOENT) {
+        return NULL;
     }
+    if (aux)
+        return ERR_PTR(aux);
     
-    printk(KERN_INFO "      LOOKUP - Archivo %s no encontrado.\n", child_dentry->d_name.name); /*** HHHH **/
-    printk(KERN_INFO "********** Fin llamada a Lookup **********\n");
+    /** 2. Si localizo la entrada, entonces tengo que construir el inodo correspondiente **/
+    // Funcion auxiliar que obtiene la info de un inodo a partir de su numero de inodo.
+    inode = assoofs_get_inode(sb, ino);
+    if (IS_ERR(inode))
+        return ERR_CAST(inode);
+    d_add(child_dentry, inode);
     
     return NULL;
 }
 
 /*************************** Funcion assoofs_get_inode (2.3.4) *****************************/
-static struct inode *assoofs_get_inode(struct super_block *sb, int ino){
+//Devuelve el inodo ino. Si ya esta en la cache de inodos del VFS no se vuelve a leer la tabla de inodos
+static struct inode *assoofs_get_inode(struct super_block *sb, uint64_t ino){
     
     //DECLARACIONES
-    struct inode *inode; //Creo el nuevo inodo
+    struct inode *inode;
     struct assoofs_inode_info *inode_info;
+    int aux;
 
-    /** 1. Obtengo la informacion persistente del inodo ino **/
-    inode_info = assoofs_get_inode_info(sb, ino);
-    
-    /** 2. Creo una nueva variable de tipo struct inode y la inicializo con funcion new_inode **/
-    //Creo nuevo inodo
-    inode = new_inode(sb);
+    /** 1. Busco el inodo en la cache; si no estaba, iget_locked me da uno nuevo bloqueado **/
+    inode = iget_locked(sb, ino);
+    if (!inode)
+        return ERR_PTR(-ENOMEM);
+    if (!(inode->i_state & I_NEW))
+        return inode;
+    
+    /** 2. Leo la informacion persistente del inodo ino, directamente en el inodo en memoria **/
+    inode_info = ASSOOFS_I(inode);
+    aux = assoofs_get_inode_info(sb, ino, inode_info);
+    if (aux) {
+        iget_failed(inode);
+        return ERR_PTR(aux);
+    }
     
-    inode->i_ino = ino;
-    inode->i_sb = sb;
+    inode_init_owner(&init_user_ns, inode, NULL, inode_info->mode);
     inode->i_op = &assoofs_inode_ops;  
     
     //Antes de asignar valor al campo i_fop debo saber si el inodo que busco es un fich o un dir
-    if (S_ISDIR(inode_info->mode))
+    if (S_ISDIR(inode_info->mode)) {
         inode->i_fop = &assoofs_dir_operations;
-    else if (S_ISREG(inode_info->mode))
+        aux = assoofs_dir_set_size(inode);
+        if (aux) {
+            iget_failed(inode);
+            return ERR_PTR(aux);
+        }
+    }
+    else if (S_ISREG(inode_info->mode)) {
         inode->i_fop = &assoofs_file_operations;
+        inode->i_mapping->a_ops = &assoofs_aops;
+        mapping_set_large_folios(inode->i_mapping);
+        inode->i_size = inode_info->file_size;
+        
+        //Un fichero inline no puede tener bloques ni pasar del tamaño del registro
+        if ((inode_info->flags & ASSOOFS_INODE_INLINE_DATA) && (inode_info->extents_count || inode_info->file_size > ASSOOFS_INLINE_DATA_MAX)) {
+            printk(KERN_ERR "El inodo %llu tiene datos inline no validos.\n", ino);
+            iget_failed(inode);
+            return ERR_PTR(-EUCLEAN);
+        }
+    }
     else
         printk(KERN_ERR "Tipo de inodo desconocido. No es ni directorio ni fichero.\n");
     
     // Asigno el valor CURRENT TIME a los campos i_atime, i_mtime y i_ctime del nuevo inodo.
     inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
     
-    // Guardo la informacion persistente del inodo obtenida en el paso 1
-    inode->i_private = assoofs_get_inode_info(sb, ino);
+    /** 3. Lo desbloqueo: a partir de aqui los demas lookups lo encuentran ya listo **/
+    unlock_new_inode(inode);
     
     return inode;
 }
 
 /************************ Funcion assoofs_sb_get_a_freeblock (2.3.4) ***************************/
+//Reserva un bloque libre cualquiera
 int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block){
     
     //DECLARACIONES
-    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
-    int i = 0;
+    uint32_t count = 1;
+    
+    return assoofs_new_blocks(sb, 0, block, &count);
+}
 
-    printk(KERN_INFO "\n********** Llamada a Get A Freeblock **********\n");
+/******************************* Funcion assoofs_sb_free_block *********************************/
+//Devuelve un bloque al mapa de bits de bloques
+void assoofs_sb_free_block(struct super_block *sb, uint64_t block){
     
-    /** 1. Compruebo que no alcanza el numeo maximo de objetos en un sistema assoofs **/
-    // Cuando aparece el 1º bit 1 en free_block dejo de recorrer el mapa de bits
-    for (i = ASSOOFS_RESERVED_INODES; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++)
-        if (assoofs_sb->free_blocks & (1 << i))
-            break; //i tiene la posicion del primer bloque libre
+    assoofs_free_blocks(sb, block, 1);
+}
+
+/******************************* Funcion assoofs_da_reserve ************************************/
+//Promete count bloques libres a una escritura diferida. No toca el mapa de bits: solo se asegura de
+//que cuando el writeback asigne los bloques habra sitio para ellos (y para los metadatos que necesiten)
+int assoofs_da_reserve(struct inode *inode, uint32_t count){
     
-       
-    //Cuando ya no queda espacio ni bloques libres
-    if((i + 1) == ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
-    	printk(KERN_ERR "Espacio en el sistema agotado.");
-    	return -28;
-    }
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(inode->i_sb);
+    struct assoofs_inode *ai = ASSOOFS_INODE(inode);
+    
+    //Dos reservas a la vez pueden pasar la comprobacion con los ultimos bloques: el margen de
+    //ASSOOFS_DA_META_RESERVE cubre esa carrera, igual que cubre los bloques de extents
+    if (!assoofs_has_free_blocks(sbi, ASSOOFS_DA_META_RESERVE + (s64)count))
+        return -ENOSPC;
+    
+    percpu_counter_add(&sbi->s_dirtyblocks_counter, count);
+    spin_lock(&ai->i_reserved_lock);
+    ai->i_reserved += count;
+    spin_unlock(&ai->i_reserved_lock);
+    return 0;
+}
+
+/******************************* Funcion assoofs_da_release ************************************/
+//Devuelve count bloques prometidos al inodo: ya se han asignado en el mapa de bits o ya no se van a escribir
+void assoofs_da_release(struct inode *inode, uint32_t count){
     
-    // Escribo el valor de i en la direccion de memoria indicada como 2º argumento en la funcion
-    *block = i;
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(inode->i_sb);
+    struct assoofs_inode *ai = ASSOOFS_INODE(inode);
     
-    /** 2. Actualizo el valor de free_blocks **/
-    assoofs_sb->free_blocks &= ~(1 << i);
+    spin_lock(&ai->i_reserved_lock);
+    if (WARN_ON_ONCE(count > ai->i_reserved))
+        count = ai->i_reserved;
     
-    //Guardo los cambios en el superbloque llamando a una funcion auxiliar
-    assoofs_save_sb_info(sb);
- 
-    printk(KERN_INFO "********** Fin llamada a Get A Freeblock **********\n");
-    return 0;
+    ai->i_reserved -= count;
+    spin_unlock(&ai->i_reserved_lock);
+    percpu_counter_sub(&sbi->s_dirtyblocks_counter, count);
 }
 
-/*************************** Funcion assoofs_save_sb_info (2.3.4) ******************************/
-void assoofs_save_sb_info(struct super_block *vsb){
+/******************************* Funcion assoofs_da_find ***************************************/
+//Tramo diferido que contiene lblock o, si no lo hay, el primero que empieza despues (o NULL).
+//Con i_data_sem cogido
+static struct assoofs_da_extent *assoofs_da_find(struct assoofs_inode *ai, uint32_t lblock){
     
     //DECLARACIONES
-    struct buffer_head *bh;
-    struct assoofs_super_block *sb = vsb->s_fs_info; //Info persistente del superbloque en memoria
-    
-    bh = sb_bread(vsb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
-    // Sobreescribo los datos de disco con la informacion en memoria
-    bh->b_data = (char *)sb;
+    struct rb_node *node = ai->i_delalloc.rb_node;
+    struct assoofs_da_extent *ext, *next = NULL;
+    
+    while (node) {
+        ext = rb_entry(node, struct assoofs_da_extent, node);
+        if (lblock < ext->lblock) {
+            next = ext;
+            node = node->rb_left;
+        }
+        else if (lblock >= (uint64_t)ext->lblock + ext->len)
+            node = node->rb_right;
+        else
+            return ext;
+    }
     
-    //Marco el bloque como sucio
-    mark_buffer_dirty(bh);
-    //Sincronizo
-    sync_dirty_buffer(bh);
-    //Libero
-    brelse(bh); /** hhhh **/
+    return next;
+}
 
+/******************************* Funcion assoofs_da_link ***************************************/
+//Mete en el arbol un tramo que no se solapa con ninguno de los que ya estan
+static void assoofs_da_link(struct assoofs_inode *ai, struct assoofs_da_extent *ext){
+    
+    //DECLARACIONES
+    struct rb_node **link = &ai->i_delalloc.rb_node, *parent = NULL;
+    
+    while (*link) {
+        parent = *link;
+        if (ext->lblock < rb_entry(parent, struct assoofs_da_extent, node)->lblock)
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+    
+    rb_link_node(&ext->node, parent, link);
+    rb_insert_color(&ext->node, &ai->i_delalloc);
 }
 
-/*************************** Funcion assoofs_add_inode_info (2.3.4) *****************************/
-void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode){
+/******************************* Funcion assoofs_da_add ****************************************/
+//Reserva los len bloques de un hueco que empieza en lblock (que no puede estar ya diferido) y los
+//anota en el arbol, pegados al tramo anterior o al siguiente si los tocan. Con i_data_sem exclusivo
+static int assoofs_da_add(struct inode *inode, uint32_t lblock, uint32_t len){
     
     //DECLARACIONES
-    struct buffer_head *bh;
-    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
-    struct assoofs_inode_info *inode_info; 
+    struct assoofs_inode *ai = ASSOOFS_INODE(inode);
+    struct assoofs_da_extent *next, *prev = NULL, *ext;
+    struct rb_node *node;
+    int aux;
     
-    printk(KERN_INFO "\n********** Llamada a Add Inode Info **********\n");
+    aux = assoofs_da_reserve(inode, len);
+    if (aux)
+        return aux;
+    
+    next = assoofs_da_find(ai, lblock);
+    node = next ? rb_prev(&next->node) : rb_last(&ai->i_delalloc);
+    if (node)
+        prev = rb_entry(node, struct assoofs_da_extent, node);
+    if (next && next->lblock != (uint64_t)lblock + len)
+        next = NULL;
+    if (prev && (uint64_t)prev->lblock + prev->len != lblock)
+        prev = NULL;
+    
+    if (prev) {
+        prev->len += len;
+        //El tramo nuevo tapa el hueco entre dos tramos
+        if (next) {
+            prev->len += next->len;
+            rb_erase(&next->node, &ai->i_delalloc);
+            kfree(next);
+        }
+    }
+    else if (next) {
+        next->lblock = lblock;
+        next->len += len;
+    }
+    else {
+        ext = kmalloc(sizeof(*ext), GFP_NOFS);
+        if (!ext) {
+            assoofs_da_release(inode, len);
+            return -ENOMEM;
+        }
+        ext->lblock = lblock;
+        ext->len = len;
+        assoofs_da_link(ai, ext);
+    }
     
-    printk(KERN_INFO "      ADD INODE - Intentando añadir nuevo inodo de %llu bytes.\n", inode->file_size);
-           
-    //Leo de disco el bloque que contiene el almacen de inodos
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+    return 0;
+}
+
+/******************************* Funcion assoofs_da_remove *************************************/
+//Quita del arbol los bloques diferidos de [lblock, lblock + len) y devuelve cuantos eran; la reserva
+//la devuelve quien llama. Con i_data_sem exclusivo. Partir un tramo en dos no puede fallar: el
+//writeback asigna bloques en medio de un tramo y no tiene como deshacerlo
+static uint32_t assoofs_da_remove(struct assoofs_inode *ai, uint32_t lblock, uint64_t len){
     
-    //Obtengo puntero al final del almacen y escribo nuevo valor final
-    inode_info = (struct assoofs_inode_info *)bh->b_data;
-    inode_info += assoofs_sb->inodes_count;
-    memcpy(inode_info, inode, sizeof(struct assoofs_inode_info));
+    //DECLARACIONES
+    struct assoofs_da_extent *ext, *split;
+    struct rb_node *node;
+    uint64_t end = (uint64_t)lblock + len, ext_end;
+    uint32_t removed = 0;
+    
+    ext = assoofs_da_find(ai, lblock);
+    while (ext && ext->lblock < end) {
+        ext_end = (uint64_t)ext->lblock + ext->len;
+        node = rb_next(&ext->node);
+        
+        if (ext->lblock < lblock && ext_end > end) {
+            split = kmalloc(sizeof(*split), GFP_NOFS | __GFP_NOFAIL);
+            split->lblock = end;
+            split->len = ext_end - end;
+            ext->len = lblock - ext->lblock;
+            assoofs_da_link(ai, split);
+            return len;
+        }
+        
+        if (ext->lblock < lblock) {
+            removed += ext_end - lblock;
+            ext->len = lblock - ext->lblock;
+        }
+        else if (ext_end > end) {
+            removed += end - ext->lblock;
+            ext->len = ext_end - end;
+            ext->lblock = end;
+        }
+        else {
+            removed += ext->len;
+            rb_erase(&ext->node, &ai->i_delalloc);
+            kfree(ext);
+        }
+        ext = node ? rb_entry(node, struct assoofs_da_extent, node) : NULL;
+    }
     
-    //Marco el bloque como sucio
-    mark_buffer_dirty(bh);
-    //Sincronizo
-    sync_dirty_buffer(bh);
+    return removed;
+}
+
+/******************************* Funcion assoofs_da_punch **************************************/
+//Devuelve la reserva de los bloques diferidos de [lblock, lblock + len) que ya no se van a escribir
+static void assoofs_da_punch(struct inode *inode, uint32_t lblock, uint64_t len){
     
-    //Libero
-    brelse(bh);
+    //DECLARACIONES
+    uint32_t removed;
     
-    //Actualizo el contador de la informacion persistente del superbloque
-    assoofs_sb->inodes_count++;
-    //Guardo los cambios
-    assoofs_save_sb_info(sb);
+    down_write(&ASSOOFS_INODE(inode)->i_data_sem);
+    removed = assoofs_da_remove(ASSOOFS_INODE(inode), lblock, len);
+    up_write(&ASSOOFS_INODE(inode)->i_data_sem);
     
-    printk(KERN_INFO "********** Fin llamada a Add Inode Info **********\n");
+    if (removed)
+        assoofs_da_release(inode, removed);
 }
 
-/************************** Funcion assoofs_save_inode_info (2.3.4) ****************************/
-int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info){
+/******************************* Funcion assoofs_new_blocks ************************************/
+//Reserva hasta *count bloques contiguos buscando a partir del bloque goal. Devuelve en *block el
+//primero y en *count cuantos se han conseguido (al menos uno, el tramo libre puede ser mas corto).
+//Cada grupo tiene su cerrojo: las reservas en grupos distintos no se esperan
+int assoofs_new_blocks(struct super_block *sb, uint64_t goal, uint64_t *block, uint32_t *count){
     
     //DECLARACIONES
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
     struct buffer_head *bh;
-    struct assoofs_inode_info *inode_pos;
-
-    //Obtengo de disco el almacen de inodos
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+    unsigned long group, start, bit, end, i, n;
+    uint32_t wanted = *count;
+    int ret = -ENOSPC;
     
-    //Busco los datos de inode_info en el almacen
-    inode_pos = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data, inode_info);
+    assoofs_stat_inc(sb, ASSOOFS_EV_ALLOC);
     
-    if(inode_pos){
-    	//Actualizo el inodo
-    	memcpy(inode_pos, inode_info, sizeof(*inode_pos));
-    	//Marco el bloque como sucio
-    	mark_buffer_dirty(bh);
-    	//Sincronizo
-    	sync_dirty_buffer(bh);
-    }
-    else{
-    	printk(KERN_ERR "No se puede guardar el nuevo tamaño en el inodo.\n");
+    //La lectura aproximada solo puede dar 0 de mas; entonces sumo los contadores de cada CPU
+    if (!percpu_counter_read_positive(&sbi->s_freeblocks_counter) && !percpu_counter_sum_positive(&sbi->s_freeblocks_counter)) {
+        printk(KERN_ERR "Espacio en el sistema agotado.");
+        goto out;
     }
     
-    //Libero Recursos
-    brelse(bh);
+    if (goal >= sbi->s_asb->blocks_count)
+        goal = 0;
+    group = goal / ASSOOFS_BLOCKS_PER_GROUP;
+    start = goal % ASSOOFS_BLOCKS_PER_GROUP;
     
-    //Si todo va bien devuelvo 0
-    return 0;
+    /** 1. Recorro los grupos a partir del de goal, saltandome los que estan llenos **/
+    //La ultima vuelta repasa el grupo de partida desde el principio
+    for (n = 0; n <= sbi->s_groups_count; n++, group = (group + 1) % sbi->s_groups_count, start = 0) {
+        if (!sbi->s_group_free[group])
+            continue;
+        
+        bh = assoofs_bread(sb, sbi->s_asb->bitmap_block + group);
+        if (!bh) {
+            ret = -EIO;
+            goto out;
+        }
+        
+        //El journal puede dormir: pido el acceso antes de coger el cerrojo del grupo
+        if (assoofs_journal_get_write_access(sb, bh)) {
+            brelse(bh);
+            ret = -EIO;
+            goto out;
+        }
+        
+        spin_lock(assoofs_group_lock(sbi, group));
+        assoofs_count_group(sb, group, bh);
+        
+        /** 2. Busco palabra a palabra el primer bloque libre (bit a 0) **/
+        bit = find_next_zero_bit_le(bh->b_data, ASSOOFS_BLOCKS_PER_GROUP, start);
+        if (bit >= ASSOOFS_BLOCKS_PER_GROUP) {
+            spin_unlock(assoofs_group_lock(sbi, group));
+            brelse(bh);
+            continue;
+        }
+        
+        /** 3. Alargo el tramo hasta el siguiente bloque ocupado, sin pasar de lo pedido **/
+        end = find_next_bit_le(bh->b_data, min_t(unsigned long, ASSOOFS_BLOCKS_PER_GROUP, bit + *count), bit);
+        for (i = bit; i < end; i++)
+            __set_bit_le(i, bh->b_data);
+        sbi->s_group_free[group] -= end - bit;
+        spin_unlock(assoofs_group_lock(sbi, group));
+        
+        assoofs_dirty_metadata(sb, bh);
+        brelse(bh);
+        
+        percpu_counter_sub(&sbi->s_freeblocks_counter, end - bit);
+        
+        *block = (uint64_t)group * ASSOOFS_BLOCKS_PER_GROUP + bit;
+        *count = end - bit;
+        ret = 0;
+        goto out;
+    }
+    
+    printk(KERN_ERR "Espacio en el sistema agotado.");
+out:
+    trace_assoofs_new_blocks(sb, goal, wanted, ret ? 0 : *block, ret ? 0 : *count, ret);
+    return ret;
 }
 
-/************************** Funcion assoofs_search_inode_info (2.3.4) ****************************/
-struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search){
+/******************************* Funcion assoofs_free_blocks ***********************************/
+//Devuelve al mapa de bits los count bloques a partir de block (pueden abarcar varios grupos)
+void assoofs_free_blocks(struct super_block *sb, uint64_t block, uint32_t count){
     
     //DECLARACIONES
-    uint64_t count = 0;
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct buffer_head *bh;
+    unsigned long group, bit, i, n, freed;
     
-    //Recorro el almacen de inodos desde start (inicio del almacen) hasta encontrar *search
-    while (start->inode_no != search->inode_no && count < ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count) {
-        count++;
-        start++; 
+    assoofs_stat_inc(sb, ASSOOFS_EV_FREE);
+    
+    if (block + count > sbi->s_asb->blocks_count) {
+        printk(KERN_ERR "ERROR, Se intenta liberar bloques fuera del dispositivo (%llu, %u).\n", block, count);
+        return;
+    }
+    
+    while (count) {
+        group = block / ASSOOFS_BLOCKS_PER_GROUP;
+        bit = block % ASSOOFS_BLOCKS_PER_GROUP;
+        n = min_t(unsigned long, count, ASSOOFS_BLOCKS_PER_GROUP - bit);
+        
+        bh = assoofs_bread(sb, sbi->s_asb->bitmap_block + group);
+        if (!bh) {
+            printk(KERN_ERR "ERROR, No se puede leer el mapa de bits del grupo %lu.\n", group);
+            return;
+        }
+        
+        //Cada grupo es un bloque mas en la transaccion: la alargo si hace falta
+        if (assoofs_journal_extend(sb, 1) || assoofs_journal_get_write_access(sb, bh)) {
+            printk(KERN_ERR "ERROR, No se puede anotar en el journal el mapa de bits del grupo %lu.\n", group);
+            brelse(bh);
+            return;
+        }
+        
+        spin_lock(assoofs_group_lock(sbi, group));
+        assoofs_count_group(sb, group, bh);
+        for (i = bit, freed = 0; i < bit + n; i++)
+            if (__test_and_clear_bit_le(i, bh->b_data))
+                freed++;
+        sbi->s_group_free[group] += freed;
+        spin_unlock(assoofs_group_lock(sbi, group));
+        
+        //Aviso fuera del cerrojo
+        if (freed != n)
+            printk(KERN_ERR "ERROR, %lu bloques del grupo %lu ya estaban libres.\n", n - freed, group);
+        
+        assoofs_dirty_metadata(sb, bh);
+        brelse(bh);
+        
+        percpu_counter_add(&sbi->s_freeblocks_counter, freed);
+        trace_assoofs_free_blocks(sb, block, n, freed);
+        
+        block += n;
+        count -= n;
     }
-    if (start->inode_no == search->inode_no)
-        return start;
-    else
-        return NULL;
 }
 
-
-/**********************************************************************************************
- *                              Montaje de dispositivos assoofs                               *
- **********************************************************************************************/
-
-static struct dentry *assoofs_mount(struct file_system_type *fs_type, int flags, const char *dev_name, void *data) {
-
+/******************************* Funcion assoofs_load_group_counts *****************************/
+//Prepara los contadores de bloques libres al montar. Si el sistema se desmonto bien, el total esta
+//en el superbloque y cada grupo se cuenta la primera vez que se lee su bloque del mapa de bits; si
+//no, recorro el mapa entero (pidiendo antes todos sus bloques, para que las lecturas se solapen).
+//mkassoofs marca como ocupados los bits que quedan mas alla del final del dispositivo
+static int assoofs_load_group_counts(struct super_block *sb){
+    
     //DECLARACIONES
-    struct dentry *ret;
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct buffer_head *bh;
+    unsigned long group;
+    uint64_t free;
+    
+    sbi->s_groups_count = DIV_ROUND_UP(sbi->s_asb->blocks_count, ASSOOFS_BLOCKS_PER_GROUP);
+    sbi->s_group_free = kvmalloc_array(sbi->s_groups_count, sizeof(*sbi->s_group_free), GFP_KERNEL);
+    if (!sbi->s_group_free)
+        return -ENOMEM;
+    for (group = 0; group < sbi->s_groups_count; group++)
+        sbi->s_group_free[group] = ASSOOFS_GROUP_UNCOUNTED;
+    
+    if ((sbi->s_asb->state & ASSOOFS_STATE_CLEAN) && sbi->s_asb->free_blocks <= sbi->s_asb->blocks_count) {
+        free = sbi->s_asb->free_blocks;
+        //El primer grupo es donde empiezan a buscar las reservas
+        sb_breadahead(sb, sbi->s_asb->bitmap_block);
+        printk(KERN_INFO "ASSOOFS: %llu bloques libres (segun el superbloque).\n", free);
+        return assoofs_init_counters(sbi, free);
+    }
     
-    printk(KERN_INFO "\n********** Llamada a Mount **********\n");
-    printk(KERN_INFO "      MOUNT - El Sistema de Ficheros ASSOOFS se montara em %s.\n", dev_name);
+    printk(KERN_INFO "ASSOOFS: el sistema no se desmonto bien, cuento los bloques libres.\n");
+    for (group = 0; group < sbi->s_groups_count; group++)
+        sb_breadahead(sb, sbi->s_asb->bitmap_block + group);
+    
+    free = 0;
+    for (group = 0; group < sbi->s_groups_count; group++) {
+        bh = assoofs_bread(sb, sbi->s_asb->bitmap_block + group);
+        if (!bh)
+            return -EIO;
+        assoofs_count_group(sb, group, bh);
+        free += sbi->s_group_free[group];
+        brelse(bh);
+    }
     
-    ret = mount_bdev(fs_type, flags, dev_name, data, assoofs_fill_super);
+    printk(KERN_INFO "ASSOOFS: %llu bloques libres en %lu grupos.\n", free, sbi->s_groups_count);
+    return assoofs_init_counters(sbi, free);
+}
 
-    // Control de errores a partir del valor de ret. En este caso se puede utilizar la macro IS_ERR: if (IS_ERR(ret)) ...
-    if(IS_ERR(ret)) printk(KERN_ERR "Error al intentar montar ASSOOFS en %s.\n", dev_name);
-    else printk(KERN_INFO "      MOUNT - El Sistema de Ficheros ASSOOFS montado correctamente en %s.\n", dev_name);
+/******************************* Funcion assoofs_init_counters *********************************/
+//Arranca los contadores por CPU que leen statfs y las reservas con el total de bloques libres
+//y los numeros de inodo que quedan en la tabla
+static int assoofs_init_counters(struct assoofs_sb_info *sbi, uint64_t free){
     
-    return ret;
+    //DECLARACIONES
+    uint64_t limit = sbi->s_asb->inode_table_blocks * ASSOOFS_INODES_PER_BLOCK;
+    uint64_t next = sbi->s_asb->inodes_count + ASSOOFS_START_INO - ASSOOFS_RESERVED_INODES + 1;
+    int err;
+    
+    err = percpu_counter_init(&sbi->s_freeblocks_counter, free, GFP_KERNEL);
+    if (!err)
+        err = percpu_counter_init(&sbi->s_dirtyblocks_counter, 0, GFP_KERNEL);
+    if (!err)
+        err = percpu_counter_init(&sbi->s_freeinodes_counter, next < limit ? limit - next : 0, GFP_KERNEL);
+    return err;
 }
 
+/*************************** Funcion assoofs_destroy_group_counts ******************************/
+//percpu_counter_destroy no hace nada con un contador sin iniciar (sbi sale de kzalloc)
+static void assoofs_destroy_group_counts(struct assoofs_sb_info *sbi){
+    
+    percpu_counter_destroy(&sbi->s_freeinodes_counter);
+    percpu_counter_destroy(&sbi->s_dirtyblocks_counter);
+    percpu_counter_destroy(&sbi->s_freeblocks_counter);
+    kvfree(sbi->s_group_free);
+}
 
-/**********************************************************************************************
+/******************************* Funcion assoofs_count_group ***********************************/
+//La primera vez que se lee el bloque del mapa de bits de un grupo cuento sus bloques libres.
+//Se llama con el cerrojo del grupo cogido (salvo al montar, cuando no hay nadie mas)
+static void assoofs_count_group(struct super_block *sb, unsigned long group, struct buffer_head *bh){
+    
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    
+    if (sbi->s_group_free[group] == ASSOOFS_GROUP_UNCOUNTED)
+        sbi->s_group_free[group] = ASSOOFS_BLOCKS_PER_GROUP - memweight(bh->b_data, ASSOOFS_DEFAULT_BLOCK_SIZE);
+}
+
+/******************************* Funcion assoofs_mount_readahead *******************************/
+//Pide sin esperar los primeros bloques (como mucho ASSOOFS_MOUNT_READAHEAD) de una region de
+//metadatos, para que las lecturas que vienen despues al montar los encuentren ya en memoria
+static void assoofs_mount_readahead(struct super_block *sb, uint64_t block, uint64_t count){
+    
+    //DECLARACIONES
+    uint64_t i;
+    
+    for (i = 0; i < min_t(uint64_t, count, ASSOOFS_MOUNT_READAHEAD); i++)
+        sb_breadahead(sb, block + i);
+}
+
+/******************************* Funcion assoofs_mark_fs_dirty *********************************/
+//Borra la marca de desmontaje limpio: a partir de aqui el total de bloques libres del superbloque
+//deja de ser fiable. Con journal va en la primera transaccion, delante de cualquier cambio del mapa
+//de bits; sin journal lo escribo en el momento
+static int assoofs_mark_fs_dirty(struct super_block *sb){
+    
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    handle_t *handle;
+    int aux;
+    
+    if (!sbi->s_journal) {
+        sbi->s_asb->state &= ~ASSOOFS_STATE_CLEAN;
+        mark_buffer_dirty(sbi->s_sbh);
+        return assoofs_sync_buffer(sb, sbi->s_sbh);
+    }
+    
+    handle = assoofs_journal_start(sb, 1, 0);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+    aux = assoofs_journal_get_write_access(sb, sbi->s_sbh);
+    if (!aux) {
+        sbi->s_asb->state &= ~ASSOOFS_STATE_CLEAN;
+        assoofs_dirty_metadata(sb, sbi->s_sbh);
+    }
+    assoofs_journal_stop(handle);
+    return aux;
+}
+
+/******************************* Funcion assoofs_mark_fs_clean *********************************/
+//Pone la marca de desmontaje limpio. Solo con todo en su sitio (el journal cerrado o vacio) el
+//total de bloques libres vuelve a ser fiable, y el siguiente montaje no tiene que recorrer el mapa
+//de bits. Se escribe directamente, fuera del journal
+static int assoofs_mark_fs_clean(struct super_block *sb){
+    
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    
+    sbi->s_asb->free_blocks = percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+    sbi->s_asb->state |= ASSOOFS_STATE_CLEAN;
+    mark_buffer_dirty(sbi->s_sbh);
+    return assoofs_sync_buffer(sb, sbi->s_sbh);
+}
+
+/*************************** Funcion assoofs_save_sb_info (2.3.4) ******************************/
+void assoofs_save_sb_info(struct super_block *vsb){
+    
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(vsb);
+    
+    //La informacion persistente en memoria esta en el propio buffer del bloque 0: basta con marcarlo
+    assoofs_dirty_metadata(vsb, sbi->s_sbh);
+}
+
+/****************************** Funcion assoofs_bread ************************************/
+//Lee un bloque de metadatos como sb_bread, pero cuenta si ya estaba en la cache o ha habido que
+//ir al disco
+struct buffer_head *assoofs_bread(struct super_block *sb, uint64_t block){
+    
+    //DECLARACIONES
+    struct buffer_head *bh;
+    
+    bh = sb_getblk(sb, block);
+    if (!bh)
+        return NULL;
+    
+    if (buffer_uptodate(bh)) {
+        assoofs_stat_inc(sb, ASSOOFS_EV_BREAD_HIT);
+        return bh;
+    }
+    
+    assoofs_stat_inc(sb, ASSOOFS_EV_BREAD);
+    if (bh_read(bh, 0) < 0) {
+        brelse(bh);
+        return NULL;
+    }
+    return bh;
+}
+
+/*************************** Funcion assoofs_sync_buffer ******************************/
+//Escribe un bloque de metadatos y espera a que llegue a disco
+int assoofs_sync_buffer(struct super_block *sb, struct buffer_head *bh){
+    
+    assoofs_stat_inc(sb, ASSOOFS_EV_SYNC_WRITE);
+    return sync_dirty_buffer(bh);
+}
+
+/*************************** Funcion assoofs_dirty_metadata ******************************/
+//Marca como sucio un bloque de metadatos. Con journal, el bloque pasa a la transaccion en curso y
+//jbd2 lo escribe en su sitio despues del commit. Sin journal solo se escribe en el momento si se
+//monta con -o sync (o dirsync); si no, lo vuelca el writeback o el commit periodico
+void assoofs_dirty_metadata(struct super_block *sb, struct buffer_head *bh){
+    
+    //DECLARACIONES
+    handle_t *handle = journal_current_handle();
+    int aux;
+    
+    if (ASSOOFS_SB(sb)->s_journal) {
+        if (WARN_ON_ONCE(!handle))
+            return;
+        aux = jbd2_journal_dirty_metadata(handle, bh);
+        if (aux)
+            printk(KERN_ERR "ERROR, No se puede anotar en el journal el bloque %llu (%d).\n", (unsigned long long)bh->b_blocknr, aux);
+        return;
+    }
+    
+    mark_buffer_dirty(bh);
+    
+    if (sb->s_flags & (SB_SYNCHRONOUS | SB_DIRSYNC))
+        assoofs_sync_buffer(sb, bh);
+}
+
+/*************************** Funcion assoofs_parse_options ******************************/
+enum { Opt_commit, Opt_err };
+
+static const match_table_t tokens = {
+    {Opt_commit, "commit=%u"},
+    {Opt_err, NULL}
+};
+
+static int assoofs_parse_options(char *options, struct assoofs_sb_info *sbi){
+    
+    //DECLARACIONES
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+    int option;
+    
+    if (!options)
+        return 0;
+    
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p)
+            continue;
+        
+        switch (match_token(p, tokens, args)) {
+        case Opt_commit:
+            if (match_int(&args[0], &option) || option < 0)
+                return -EINVAL;
+            sbi->s_commit_interval = option ? option : ASSOOFS_DEFAULT_COMMIT_INTERVAL;
+            break;
+        default:
+            printk(KERN_ERR "Opcion de montaje desconocida: %s.\n", p);
+            return -EINVAL;
+        }
+    }
+    
+    return 0;
+}
+
+/*************************** Funcion assoofs_add_inode_info (2.3.4) *****************************/
+void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode){
+    
+    //DECLARACIONES
+    struct buffer_head *bh;
+    struct assoofs_inode_info *inode_info; 
+    
+    //Leo de disco el bloque de la tabla de inodos donde va el nuevo inodo
+    bh = assoofs_read_inode_block(sb, inode->inode_no, &inode_info);
+    if (!bh) {
+        printk(KERN_ERR "No se puede leer la tabla de inodos.\n");
+        trace_assoofs_add_inode_info(sb, inode->inode_no, -EIO);
+        return;
+    }
+    
+    if (assoofs_journal_get_write_access(sb, bh)) {
+        brelse(bh);
+        trace_assoofs_add_inode_info(sb, inode->inode_no, -EIO);
+        return;
+    }
+    
+    //Escribo el registro en su posicion
+    memcpy(inode_info, inode, sizeof(struct assoofs_inode_info));
+    
+    //Marco el bloque como sucio
+    assoofs_dirty_metadata(sb, bh);
+    
+    //Libero
+    brelse(bh);
+    
+    //El contador de inodos del superbloque ya lo subio assoofs_new_inode_no
+    
+    trace_assoofs_add_inode_info(sb, inode->inode_no, 0);
+}
+
+/*************************** Funcion assoofs_new_inode_no ******************************/
+//Reserva el numero de un inodo nuevo (la siguiente posicion de la tabla) y lo cuenta en el
+//superbloque. Solo el contador va bajo s_inode_lock, asi que los create/mkdir en directorios
+//distintos (cada uno con su i_rwsem) apenas se esperan entre ellos
+int assoofs_new_inode_no(struct super_block *sb, uint64_t *ino){
+    
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t limit = sbi->s_asb->inode_table_blocks * ASSOOFS_INODES_PER_BLOCK;
+    int aux;
+    
+    aux = assoofs_journal_get_write_access(sb, sbi->s_sbh);
+    if (aux)
+        return aux;
+    
+    spin_lock(&sbi->s_inode_lock);
+    *ino = sbi->s_asb->inodes_count + ASSOOFS_START_INO - ASSOOFS_RESERVED_INODES + 1;
+    //Compruebo que el numero del nuevo inodo cabe en la tabla de inodos. Quedarse sin inodos es
+    //falta de espacio, como en cualquier otro sistema de ficheros
+    if (*ino >= limit) {
+        spin_unlock(&sbi->s_inode_lock);
+        pr_warn_ratelimited("ASSOOFS: la tabla de inodos esta llena.\n");
+        trace_assoofs_new_inode_no(sb, *ino, -ENOSPC);
+        return -ENOSPC;
+    }
+    sbi->s_asb->inodes_count++;
+    spin_unlock(&sbi->s_inode_lock);
+    percpu_counter_dec(&sbi->s_freeinodes_counter);
+    
+    assoofs_save_sb_info(sb);
+    trace_assoofs_new_inode_no(sb, *ino, 0);
+    return 0;
+}
+
+/*************************** Funcion assoofs_release_inode_no ******************************/
+//Devuelve el numero de un create/mkdir que ha fallado. Si otro ha reservado ya el siguiente, la
+//posicion se queda sin usar
+void assoofs_release_inode_no(struct super_block *sb, uint64_t ino){
+    
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    
+    spin_lock(&sbi->s_inode_lock);
+    if (ino == sbi->s_asb->inodes_count + ASSOOFS_START_INO - ASSOOFS_RESERVED_INODES) {
+        sbi->s_asb->inodes_count--;
+        percpu_counter_inc(&sbi->s_freeinodes_counter);
+    }
+    spin_unlock(&sbi->s_inode_lock);
+    
+    assoofs_save_sb_info(sb);
+}
+
+/************************** Funcion assoofs_save_inode_info (2.3.4) ****************************/
+int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info){
+    
+    //DECLARACIONES
+    struct buffer_head *bh;
+    struct assoofs_inode_info *inode_pos;
+    int aux = 0;
+
+    //Obtengo de disco el bloque de la tabla de inodos con el registro de inode_info
+    bh = assoofs_read_inode_block(sb, inode_info->inode_no, &inode_pos);
+    if (!bh) {
+        aux = -EIO;
+        goto out;
+    }
+    
+    if (assoofs_journal_get_write_access(sb, bh)) {
+        brelse(bh);
+        aux = -EIO;
+        goto out;
+    }
+    
+    if(inode_pos->inode_no == inode_info->inode_no){
+    	//Actualizo el inodo
+    	memcpy(inode_pos, inode_info, sizeof(*inode_pos));
+    	//Marco el bloque como sucio
+    	assoofs_dirty_metadata(sb, bh);
+    }
+    else{
+    	printk(KERN_ERR "No se puede guardar el nuevo tamaño en el inodo.\n");
+    }
+    
+    //Libero Recursos
+    brelse(bh);
+    
+out:
+    trace_assoofs_save_inode_info(sb, inode_info->inode_no, aux);
+    return aux;
+}
+
+
+/**********************************************************************************************
+ *                                Journal de metadatos (jbd2)                                 *
+ **********************************************************************************************/
+
+/******************************* Funcion assoofs_journal_load **********************************/
+//Abre el journal que ocupa los bloques [journal_block, journal_block + journal_blocks) del propio
+//dispositivo. Si el sistema no se desmonto bien, jbd2_journal_load rehace las transacciones confirmadas,
+//aunque el montaje sea de solo lectura (como ext4); si el dispositivo no admite escrituras no hay
+//forma de rehacerlas y el montaje se rechaza. Con el journal limpio, cargarlo no escribe nada
+static int assoofs_journal_load(struct super_block *sb){
+
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_super_block_info *asb = sbi->s_asb;
+    struct buffer_head *bh;
+    journal_superblock_t *jsb;
+    journal_t *journal;
+    bool needs_recovery;
+    int aux;
+
+    if (!asb->journal_blocks) {
+        printk(KERN_INFO "ASSOOFS: formateado sin journal, los metadatos se escriben sin transacciones.\n");
+        return 0;
+    }
+
+    //jbd2 tiene transacciones por rehacer cuando s_start del superbloque del journal no es 0
+    bh = sb_bread(sb, asb->journal_block);
+    if (!bh)
+        return -EIO;
+    jsb = (journal_superblock_t *)bh->b_data;
+    needs_recovery = jsb->s_header.h_magic == cpu_to_be32(JBD2_MAGIC_NUMBER) && jsb->s_start;
+    brelse(bh);
+
+    if (needs_recovery && sb_rdonly(sb)) {
+        if (bdev_read_only(sb->s_bdev)) {
+            printk(KERN_ERR "ERROR, El journal de ASSOOFS tiene transacciones por rehacer y el dispositivo es de solo lectura.\n");
+            return -EROFS;
+        }
+        printk(KERN_INFO "ASSOOFS: se rehace el journal en un montaje de solo lectura.\n");
+    }
+
+    journal = jbd2_journal_init_dev(sb->s_bdev, sb->s_bdev, asb->journal_block, asb->journal_blocks, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    if (!journal)
+        return -ENOMEM;
+    journal->j_private = sb;
+
+    aux = jbd2_journal_load(journal);
+    if (aux) {
+        printk(KERN_ERR "ERROR, El journal de ASSOOFS esta corrupto (%d).\n", aux);
+        jbd2_journal_destroy(journal);
+        return aux;
+    }
+
+    //Las transacciones de todas las operaciones se agrupan en una sola hasta commit= segundos (o hasta
+    //un fsync), que se escribe seguida en el journal
+    write_lock(&journal->j_state_lock);
+    journal->j_commit_interval = sbi->s_commit_interval * HZ;
+    journal->j_flags |= JBD2_BARRIER;
+    write_unlock(&journal->j_state_lock);
+
+    sbi->s_journal = journal;
+    printk(KERN_INFO "ASSOOFS: journal de %llu bloques en el bloque %llu.\n", asb->journal_blocks, asb->journal_block);
+    return 0;
+}
+
+/******************************* Funcion assoofs_journal_destroy *******************************/
+//Cierra el journal: confirma la transaccion en curso y escribe en su sitio todo lo confirmado
+static void assoofs_journal_destroy(struct super_block *sb){
+
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+    if (!sbi->s_journal)
+        return;
+
+    if (jbd2_journal_destroy(sbi->s_journal))
+        printk(KERN_ERR "ERROR, El journal de ASSOOFS no se ha cerrado correctamente.\n");
+    sbi->s_journal = NULL;
+}
+
+/******************************* Funcion assoofs_journal_start *********************************/
+//Abre una transaccion para modificar hasta nblocks bloques de metadatos y liberar revokes de ellos.
+//Si el hilo ya tiene una abierta, la operacion se anida en ella. Sin journal devuelve NULL
+handle_t *assoofs_journal_start(struct super_block *sb, int nblocks, int revokes){
+
+    //DECLARACIONES
+    journal_t *journal = ASSOOFS_SB(sb)->s_journal;
+    handle_t *handle;
+
+    if (!journal)
+        return NULL;
+
+    handle = jbd2__journal_start(journal, nblocks, 0, revokes, GFP_NOFS, 0, 0);
+    if (!IS_ERR(handle) && (sb->s_flags & (SB_SYNCHRONOUS | SB_DIRSYNC)))
+        handle->h_sync = 1;
+
+    return handle;
+}
+
+/******************************* Funcion assoofs_journal_stop **********************************/
+int assoofs_journal_stop(handle_t *handle){
+
+    if (!handle)
+        return 0;
+
+    return jbd2_journal_stop(handle);
+}
+
+/******************************* Funcion assoofs_journal_get_write_access **********************/
+//Hay que llamarla antes de modificar un bloque de metadatos: si el bloque esta en una transaccion
+//que se esta escribiendo, jbd2 guarda una copia para que el commit no vea los cambios a medias
+int assoofs_journal_get_write_access(struct super_block *sb, struct buffer_head *bh){
+
+    //DECLARACIONES
+    handle_t *handle = journal_current_handle();
+
+    if (!ASSOOFS_SB(sb)->s_journal)
+        return 0;
+
+    if (WARN_ON_ONCE(!handle))
+        return -EIO;
+
+    return jbd2_journal_get_write_access(handle, bh);
+}
+
+/******************************* Funcion assoofs_journal_get_create_access *********************/
+//Igual que la anterior para un bloque de metadatos recien reservado, cuyo contenido viejo no importa.
+//Si el bloque se habia revocado, deja de estarlo
+int assoofs_journal_get_create_access(struct super_block *sb, struct buffer_head *bh){
+
+    //DECLARACIONES
+    handle_t *handle = journal_current_handle();
+
+    if (!ASSOOFS_SB(sb)->s_journal)
+        return 0;
+
+    if (WARN_ON_ONCE(!handle))
+        return -EIO;
+
+    return jbd2_journal_get_create_access(handle, bh);
+}
+
+/******************************* Funcion assoofs_journal_extend ********************************/
+//Se asegura de que a la transaccion en curso le quedan nblocks bloques. Si no se puede alargar, se
+//confirma lo hecho hasta ahora y la operacion sigue en una transaccion nueva
+int assoofs_journal_extend(struct super_block *sb, int nblocks){
+
+    //DECLARACIONES
+    handle_t *handle = journal_current_handle();
+    int aux;
+
+    if (!ASSOOFS_SB(sb)->s_journal || !handle)
+        return 0;
+
+    if (jbd2_handle_buffer_credits(handle) >= nblocks)
+        return 0;
+
+    aux = jbd2_journal_extend(handle, nblocks, 0);
+    if (aux > 0)
+        aux = jbd2__journal_restart(handle, nblocks, handle->h_revoke_credits, GFP_NOFS);
+
+    return aux;
+}
+
+/******************************* Funcion assoofs_journal_forget ********************************/
+//Revoca un bloque de metadatos que se va a liberar: al rehacer el journal no se escribira encima
+//de lo que se guarde despues en el. Si estaba en la transaccion en curso, sale de ella.
+//Sin journal basta con tirar su buffer: si estaba sucio, el writeback lo escribiria encima de lo
+//que se guarde despues en el bloque
+int assoofs_journal_forget(struct super_block *sb, uint64_t block){
+
+    //DECLARACIONES
+    handle_t *handle = journal_current_handle();
+
+    if (!ASSOOFS_SB(sb)->s_journal) {
+        bforget(sb_find_get_block(sb, block));
+        return 0;
+    }
+
+    if (WARN_ON_ONCE(!handle))
+        return -EIO;
+
+    //jbd2_journal_revoke se queda con la referencia al buffer
+    return jbd2_journal_revoke(handle, block, sb_find_get_block(sb, block));
+}
+
+
+/**********************************************************************************************
+ *                                      Mapa de extents                                       *
+ **********************************************************************************************/
+
+/******************************* Funcion assoofs_map_block *************************************/
+//Traduce el bloque logico iblock del inodo a su bloque fisico. Devuelve 1 si esta asignado
+//(en len deja cuantos bloques contiguos quedan en el tramo), 0 si es un hueco y <0 si hay error
+int assoofs_map_block(struct super_block *sb, struct assoofs_inode_info *inode_info, uint32_t iblock, uint64_t *pblock, uint32_t *len){
+    
+    //DECLARACIONES
+    struct buffer_head *bh = NULL;
+    struct assoofs_extent *ext = inode_info->extents;
+    uint32_t i;
+    int ret = 0;
+    
+    *len = 0;
+    
+    /** 1. Recorro los tramos (ordenados por bloque logico): primero los del inodo y luego los del bloque de extents **/
+    for (i = 0; i < inode_info->extents_count; i++, ext++) {
+        if (i == ASSOOFS_INLINE_EXTENTS) {
+            bh = assoofs_bread(sb, inode_info->extent_block);
+            if (!bh)
+                return -EIO;
+            ext = ((struct assoofs_extent_block *)bh->b_data)->eb_extents;
+        }
+        
+        //El bloque cae en el hueco anterior a este tramo
+        if (iblock < ext->ee_block) {
+            *len = ext->ee_block - iblock;
+            break;
+        }
+        
+        if (iblock < ext->ee_block + ext->ee_len) {
+            *pblock = ext->ee_start + (iblock - ext->ee_block);
+            *len = ext->ee_block + ext->ee_len - iblock;
+            ret = 1;
+            break;
+        }
+    }
+    
+    /** 2. Libero recursos **/
+    if (bh)
+        brelse(bh);
+    
+    return ret;
+}
+
+/******************************* Funcion assoofs_load_extents **********************************/
+//Copia en exts todos los tramos del inodo (los del registro y los del bloque de extents)
+static int assoofs_load_extents(struct super_block *sb, struct assoofs_inode_info *inode_info, struct assoofs_extent *exts){
+    
+    //DECLARACIONES
+    struct buffer_head *bh;
+    uint32_t inline_count = min_t(uint32_t, inode_info->extents_count, ASSOOFS_INLINE_EXTENTS);
+    
+    memcpy(exts, inode_info->extents, inline_count * sizeof(*exts));
+    
+    if (inode_info->extents_count > ASSOOFS_INLINE_EXTENTS) {
+        bh = assoofs_bread(sb, inode_info->extent_block);
+        if (!bh)
+            return -EIO;
+        memcpy(exts + ASSOOFS_INLINE_EXTENTS, ((struct assoofs_extent_block *)bh->b_data)->eb_extents,
+               (inode_info->extents_count - ASSOOFS_INLINE_EXTENTS) * sizeof(*exts));
+        brelse(bh);
+    }
+    
+    return inode_info->extents_count;
+}
+
+/******************************* Funcion assoofs_store_extents *********************************/
+//Reparte los count tramos de exts entre el registro del inodo y su bloque de extents.
+//El registro del inodo lo guarda quien llama
+static int assoofs_store_extents(struct super_block *sb, struct assoofs_inode_info *inode_info, struct assoofs_extent *exts, uint32_t count){
+    
+    //DECLARACIONES
+    struct buffer_head *bh;
+    struct assoofs_extent_block *eb;
+    uint64_t block = 0;
+    int aux = 0;
+    
+    //El registro no se toca hasta tener el bloque de extents listo: si algo falla, el inodo se
+    //queda con su mapa anterior entero
+    if (count > ASSOOFS_INLINE_EXTENTS) {
+        //Los tramos ya no caben en el inodo: desbordo al bloque de extents, reservandolo si hace falta
+        if (!inode_info->extent_block) {
+            aux = assoofs_sb_get_a_freeblock(sb, &block);
+            if (aux < 0)
+                return aux;
+            bh = sb_getblk(sb, block);
+            if (bh) {
+                lock_buffer(bh);
+                aux = assoofs_journal_get_create_access(sb, bh);
+                memset(bh->b_data, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+                set_buffer_uptodate(bh);
+                unlock_buffer(bh);
+            }
+        }
+        else {
+            bh = assoofs_bread(sb, inode_info->extent_block);
+            if (bh)
+                aux = assoofs_journal_get_write_access(sb, bh);
+        }
+        
+        if (!bh)
+            aux = -EIO;
+        if (aux) {
+            brelse(bh);
+            //El bloque recien reservado vuelve al mapa de bits
+            if (block)
+                assoofs_sb_free_block(sb, block);
+            return aux;
+        }
+        
+        eb = (struct assoofs_extent_block *)bh->b_data;
+        eb->eb_count = count - ASSOOFS_INLINE_EXTENTS;
+        memcpy(eb->eb_extents, exts + ASSOOFS_INLINE_EXTENTS, eb->eb_count * sizeof(*exts));
+        
+        //Marco el bloque como sucio
+        assoofs_dirty_metadata(sb, bh);
+        //Libero
+        brelse(bh);
+        
+        if (block)
+            inode_info->extent_block = block;
+    }
+    
+    memcpy(inode_info->extents, exts, min_t(uint32_t, count, ASSOOFS_INLINE_EXTENTS) * sizeof(*exts));
+    inode_info->extents_count = count;
+    return 0;
+}
+
+/******************************* Funcion assoofs_alloc_block ***********************************/
+//Asigna bloques fisicos seguidos a los *len bloques logicos que empiezan en iblock (que deben ser un
+//hueco) y los anota en el mapa de extents, fusionandolos con el tramo anterior o el siguiente cuando
+//quedan contiguos en disco. En *len deja cuantos se han asignado (al menos uno)
+int assoofs_alloc_block(struct super_block *sb, struct assoofs_inode_info *inode_info, uint32_t iblock, uint64_t *pblock, uint32_t *len){
+    
+    //DECLARACIONES
+    struct assoofs_extent *exts;
+    uint32_t count, i;
+    uint64_t goal = 0;
+    int aux;
+    
+    exts = kmalloc_array(ASSOOFS_MAX_EXTENTS, sizeof(*exts), GFP_KERNEL);
+    if (!exts)
+        return -ENOMEM;
+    
+    aux = assoofs_load_extents(sb, inode_info, exts);
+    if (aux < 0)
+        goto out;
+    count = aux;
+    
+    /** 1. Busco el primer tramo que empieza despues de iblock **/
+    for (i = 0; i < count && exts[i].ee_block < iblock; i++)
+        ;
+    
+    /** 2. Reservo el bloque fisico, intentando que quede a continuacion del tramo anterior **/
+    if (i > 0)
+        goal = exts[i - 1].ee_start + (iblock - exts[i - 1].ee_block);
+    aux = assoofs_new_blocks(sb, goal, pblock, len);
+    if (aux < 0)
+        goto out;
+    
+    /** 3. Fusiono con los vecinos o inserto un tramo nuevo **/
+    if (i > 0 && exts[i - 1].ee_block + exts[i - 1].ee_len == iblock && exts[i - 1].ee_start + exts[i - 1].ee_len == *pblock) {
+        exts[i - 1].ee_len += *len;
+        //El tramo nuevo puede tapar el hueco entre dos tramos
+        if (i < count && exts[i].ee_block == iblock + *len && exts[i].ee_start == *pblock + *len) {
+            exts[i - 1].ee_len += exts[i].ee_len;
+            memmove(&exts[i], &exts[i + 1], (count - i - 1) * sizeof(*exts));
+            count--;
+        }
+    }
+    else if (i < count && exts[i].ee_block == iblock + *len && exts[i].ee_start == *pblock + *len) {
+        exts[i].ee_block -= *len;
+        exts[i].ee_start -= *len;
+        exts[i].ee_len += *len;
+    }
+    else {
+        if (count == ASSOOFS_MAX_EXTENTS) {
+            printk(KERN_ERR "El inodo %llu ha alcanzado el numero maximo de extents.\n", inode_info->inode_no);
+            assoofs_free_blocks(sb, *pblock, *len);
+            aux = -EFBIG;
+            goto out;
+        }
+        memmove(&exts[i + 1], &exts[i], (count - i) * sizeof(*exts));
+        exts[i].ee_block = iblock;
+        exts[i].ee_len = *len;
+        exts[i].ee_start = *pblock;
+        count++;
+    }
+    
+    /** 4. Guardo el mapa **/
+    aux = assoofs_store_extents(sb, inode_info, exts, count);
+    if (aux < 0)
+        assoofs_free_blocks(sb, *pblock, *len);
+    
+out:
+    kfree(exts);
+    return aux;
+}
+
+/******************************* Funcion assoofs_truncate_blocks *******************************/
+//Libera los bloques del inodo que quedan enteros por encima de size y recorta el mapa de extents.
+//El registro del inodo lo guarda quien llama
+int assoofs_truncate_blocks(struct super_block *sb, struct assoofs_inode_info *inode_info, loff_t size){
+    
+    //DECLARACIONES
+    struct assoofs_extent *exts;
+    uint32_t first = DIV_ROUND_UP(size, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    uint32_t count, i, keep, n;
+    int aux;
+    
+    exts = kmalloc_array(ASSOOFS_MAX_EXTENTS, sizeof(*exts), GFP_KERNEL);
+    if (!exts)
+        return -ENOMEM;
+    
+    aux = assoofs_load_extents(sb, inode_info, exts);
+    if (aux < 0)
+        goto out;
+    count = aux;
+    
+    /** 1. Libero los bloques de cada tramo que quedan por encima del nuevo final **/
+    for (i = 0; i < count; i++) {
+        if (exts[i].ee_block + exts[i].ee_len <= first)
+            continue;
+        keep = exts[i].ee_block < first ? first - exts[i].ee_block : 0;
+        if (exts[i].ee_len > keep) {
+            //Los bloques de un directorio son metadatos: al rehacer el journal no deben volver a escribirse
+            if (S_ISDIR(inode_info->mode))
+                for (n = keep; n < exts[i].ee_len; n++)
+                    assoofs_journal_forget(sb, exts[i].ee_start + n);
+            assoofs_free_blocks(sb, exts[i].ee_start + keep, exts[i].ee_len - keep);
+            exts[i].ee_len = keep;
+        }
+    }
+    
+    /** 2. Quito los tramos que se han quedado vacios (estan al final, el mapa esta ordenado) **/
+    while (count > 0 && exts[count - 1].ee_len == 0)
+        count--;
+    
+    /** 3. Si ya caben todos en el inodo, devuelvo el bloque de extents **/
+    if (count <= ASSOOFS_INLINE_EXTENTS && inode_info->extent_block) {
+        assoofs_journal_forget(sb, inode_info->extent_block);
+        assoofs_sb_free_block(sb, inode_info->extent_block);
+        inode_info->extent_block = 0;
+    }
+    
+    aux = assoofs_store_extents(sb, inode_info, exts, count);
+    
+out:
+    kfree(exts);
+    return aux;
+}
+
+
+/**********************************************************************************************
+ *                               Indice de directorios (htree)                                *
+ **********************************************************************************************/
+
+/******************************* Funcion assoofs_dir_bread *************************************/
+//Lee el bloque logico lblock del directorio dir
+static struct buffer_head *assoofs_dir_bread(struct inode *dir, uint32_t lblock){
+
+    //DECLARACIONES
+    uint64_t pblock;
+    uint32_t len;
+
+    if (assoofs_map_block(dir->i_sb, ASSOOFS_I(dir), lblock, &pblock, &len) <= 0) {
+        printk(KERN_ERR "ERROR, El directorio %lu no tiene el bloque %u.\n", dir->i_ino, lblock);
+        return NULL;
+    }
+
+    return assoofs_bread(dir->i_sb, pblock);
+}
+
+/******************************* Funcion assoofs_dir_set_size **********************************/
+//El tamaño de un directorio son los bloques que ocupa, que se apuntan en la raiz de su indice
+static int assoofs_dir_set_size(struct inode *dir){
+
+    //DECLARACIONES
+    struct buffer_head *bh;
+
+    bh = assoofs_dir_bread(dir, 0);
+    if (!bh)
+        return -EIO;
+
+    i_size_write(dir, (loff_t)((struct assoofs_dx_root *)bh->b_data)->blocks * ASSOOFS_DEFAULT_BLOCK_SIZE);
+    brelse(bh);
+    return 0;
+}
+
+/******************************* Funcion assoofs_dir_new_block *********************************/
+//Asigna al directorio dir el bloque logico lblock y lo devuelve a cero. Quien llama lo marca sucio
+static struct buffer_head *assoofs_dir_new_block(struct inode *dir, uint32_t lblock, int *err){
+
+    //DECLARACIONES
+    struct buffer_head *bh;
+    uint64_t pblock;
+    uint32_t len = 1;
+
+    *err = assoofs_alloc_block(dir->i_sb, ASSOOFS_I(dir), lblock, &pblock, &len);
+    if (*err)
+        return NULL;
+
+    bh = sb_getblk(dir->i_sb, pblock);
+    if (!bh) {
+        *err = -ENOMEM;
+        return NULL;
+    }
+
+    lock_buffer(bh);
+    *err = assoofs_journal_get_create_access(dir->i_sb, bh);
+    if (*err) {
+        unlock_buffer(bh);
+        brelse(bh);
+        return NULL;
+    }
+    memset(bh->b_data, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+
+    //El mapa de extents y el tamaño del directorio han cambiado
+    if (i_size_read(dir) < (loff_t)(lblock + 1) * ASSOOFS_DEFAULT_BLOCK_SIZE)
+        i_size_write(dir, (loff_t)(lblock + 1) * ASSOOFS_DEFAULT_BLOCK_SIZE);
+    mark_inode_dirty(dir);
+    return bh;
+}
+
+/******************************* Funcion assoofs_dx_init ***************************************/
+//Crea el indice de un directorio vacio: la raiz en el bloque 0 y una hoja vacia en el bloque 1
+static int assoofs_dx_init(struct inode *dir){
+
+    //DECLARACIONES
+    struct buffer_head *root_bh, *leaf_bh;
+    struct assoofs_dx_root *root;
+    int aux;
+
+    root_bh = assoofs_dir_new_block(dir, 0, &aux);
+    if (!root_bh)
+        return aux;
+
+    leaf_bh = assoofs_dir_new_block(dir, 1, &aux);
+    if (!leaf_bh) {
+        brelse(root_bh);
+        return aux;
+    }
+
+    //La hoja vacia es una sola entrada libre que ocupa todo el bloque
+    ((struct assoofs_dir_record_entry *)leaf_bh->b_data)->rec_len = ASSOOFS_DEFAULT_BLOCK_SIZE;
+
+    root = (struct assoofs_dx_root *)root_bh->b_data;
+    root->magic = ASSOOFS_DX_MAGIC;
+    root->levels = 0;
+    root->count = 1;
+    root->blocks = 2;
+    root->entries[0].hash = 0;
+    root->entries[0].block = 1;
+
+    assoofs_dirty_metadata(dir->i_sb, leaf_bh);
+    assoofs_dirty_metadata(dir->i_sb, root_bh);
+    brelse(leaf_bh);
+    brelse(root_bh);
+    return 0;
+}
+
+/******************************* Funcion assoofs_dx_probe **************************************/
+//Baja por el indice de dir hasta la hoja que corresponde a hash. En frames deja el camino recorrido
+//(la raiz y, si lo hay, el nodo intermedio); quien llama libera sus buffers con assoofs_dx_release
+static int assoofs_dx_probe(struct inode *dir, uint32_t hash, struct assoofs_dx_frame *frames, uint32_t *levels){
+
+    //DECLARACIONES
+    struct assoofs_dx_root *root;
+    struct assoofs_dx_node *node;
+
+    memset(frames, 0, ASSOOFS_DX_MAX_LEVELS * sizeof(*frames));
+
+    /** 1. Raiz del indice **/
+    frames[0].bh = assoofs_dir_bread(dir, 0);
+    if (!frames[0].bh)
+        return -EIO;
+
+    root = (struct assoofs_dx_root *)frames[0].bh->b_data;
+    if (root->magic != ASSOOFS_DX_MAGIC || root->levels >= ASSOOFS_DX_MAX_LEVELS || !root->count || root->count > ASSOOFS_DX_ROOT_LIMIT) {
+        printk(KERN_ERR "ERROR, Indice corrupto en el directorio %lu.\n", dir->i_ino);
+        brelse(frames[0].bh);
+        frames[0].bh = NULL;
+        return -EIO;
+    }
+
+    *levels = root->levels;
+    frames[0].entries = root->entries;
+    frames[0].count = &root->count;
+    frames[0].limit = ASSOOFS_DX_ROOT_LIMIT;
+    frames[0].at = assoofs_dx_search(root->entries, root->count, hash);
+
+    /** 2. Nodo intermedio, si el indice tiene dos niveles **/
+    if (*levels) {
+        frames[1].bh = assoofs_dir_bread(dir, frames[0].at->block);
+        if (!frames[1].bh) {
+            brelse(frames[0].bh);
+            frames[0].bh = NULL;
+            return -EIO;
+        }
+        node = (struct assoofs_dx_node *)frames[1].bh->b_data;
+        frames[1].entries = node->entries;
+        frames[1].count = &node->count;
+        frames[1].limit = ASSOOFS_DX_NODE_LIMIT;
+        frames[1].at = assoofs_dx_search(node->entries, node->count, hash);
+    }
+
+    return 0;
+}
+
+/******************************* Funcion assoofs_dx_release ************************************/
+static void assoofs_dx_release(struct assoofs_dx_frame *frames){
+
+    //DECLARACIONES
+    int i;
+
+    for (i = 0; i < ASSOOFS_DX_MAX_LEVELS; i++)
+        if (frames[i].bh)
+            brelse(frames[i].bh);
+}
+
+/******************************* Funcion assoofs_dir_entry *************************************/
+//Devuelve la entrada que empieza en offset dentro de un bloque de directorio, comprobando antes que
+//su encadenamiento es coherente. NULL si el bloque esta corrupto
+static struct assoofs_dir_record_entry *assoofs_dir_entry(struct buffer_head *bh, unsigned int offset){
+
+    if (!assoofs_dir_rec_valid(bh->b_data, offset)) {
+        printk(KERN_ERR "ERROR, Entrada de directorio corrupta en el bloque %llu (desplazamiento %u).\n", (unsigned long long)bh->b_blocknr, offset);
+        return NULL;
+    }
+
+    return (struct assoofs_dir_record_entry *)(bh->b_data + offset);
+}
+
+/******************************* Funcion assoofs_dx_find_in_leaf *******************************/
+//Busca el nombre name en una hoja del directorio. NULL si no esta, ERR_PTR(-EIO) si la hoja esta corrupta
+static struct assoofs_dir_record_entry *assoofs_dx_find_in_leaf(struct buffer_head *bh, const char *name, unsigned int len){
+
+    //DECLARACIONES
+    struct assoofs_dir_record_entry *record;
+    unsigned int offset;
+
+    for (offset = 0; offset < ASSOOFS_DEFAULT_BLOCK_SIZE; offset += record->rec_len) {
+        record = assoofs_dir_entry(bh, offset);
+        if (!record)
+            return ERR_PTR(-EIO);
+        if (record->inode_no && record->name_len == len && !memcmp(record->filename, name, len))
+            return record;
+    }
+
+    return NULL;
+}
+
+/******************************* Funcion assoofs_dx_find_entry *********************************/
+//Busca name en el directorio dir leyendo solo el camino del indice y una hoja. Devuelve 0 y deja el
+//numero de inodo en ino, -ENOENT si no esta o <0 si hay error
+int assoofs_dx_find_entry(struct inode *dir, const char *name, unsigned int len, uint64_t *ino){
+
+    //DECLARACIONES
+    struct assoofs_dx_frame frames[ASSOOFS_DX_MAX_LEVELS];
+    struct assoofs_dir_record_entry *record;
+    struct buffer_head *bh;
+    uint32_t levels;
+    int aux;
+
+    aux = assoofs_dx_probe(dir, assoofs_dx_hash(name, len), frames, &levels);
+    if (aux)
+        return aux;
+
+    bh = assoofs_dir_bread(dir, frames[levels].at->block);
+    assoofs_dx_release(frames);
+    if (!bh)
+        return -EIO;
+
+    record = assoofs_dx_find_in_leaf(bh, name, len);
+    if (IS_ERR(record))
+        aux = PTR_ERR(record);
+    else if (record)
+        *ino = record->inode_no;
+    else
+        aux = -ENOENT;
+
+    brelse(bh);
+    return aux;
+}
+
+/******************************* Funcion assoofs_dx_insert *************************************/
+//Mete la entrada (hash, block) en el nivel frame justo detras de frame->at
+static void assoofs_dx_insert(struct assoofs_dx_frame *frame, uint32_t hash, uint32_t block){
+
+    //DECLARACIONES
+    struct assoofs_dx_entry *new = frame->at + 1;
+
+    memmove(new + 1, new, (frame->entries + *frame->count - new) * sizeof(*new));
+    new->hash = hash;
+    new->block = block;
+    (*frame->count)++;
+}
+
+/******************************* Funcion assoofs_dx_grow ***************************************/
+//Hace sitio en el nivel del indice que apunta a las hojas cuando esta lleno. Si es la raiz, sus
+//entradas bajan a un nodo nuevo y el indice pasa a tener dos niveles; si es un nodo intermedio,
+//se parte en dos y la mitad alta se cuelga de la raiz
+static int assoofs_dx_grow(struct inode *dir, struct assoofs_dx_frame *frames, uint32_t *levels, uint32_t hash){
+
+    //DECLARACIONES
+    struct super_block *sb = dir->i_sb;
+    struct assoofs_dx_root *root = (struct assoofs_dx_root *)frames[0].bh->b_data;
+    struct assoofs_dx_node *node;
+    struct buffer_head *bh;
+    uint32_t half;
+    int aux;
+
+    aux = assoofs_journal_get_write_access(sb, frames[0].bh);
+    if (aux)
+        return aux;
+
+    if (*levels == 0) {
+        /** 1. La raiz esta llena: todas sus entradas pasan a un nodo intermedio **/
+        bh = assoofs_dir_new_block(dir, root->blocks, &aux);
+        if (!bh)
+            return aux;
+
+        node = (struct assoofs_dx_node *)bh->b_data;
+        node->fake_rec_len = ASSOOFS_DEFAULT_BLOCK_SIZE;
+        node->count = root->count;
+        memcpy(node->entries, root->entries, root->count * sizeof(struct assoofs_dx_entry));
+
+        frames[1].bh = bh;
+        frames[1].entries = node->entries;
+        frames[1].count = &node->count;
+        frames[1].limit = ASSOOFS_DX_NODE_LIMIT;
+        frames[1].at = node->entries + (frames[0].at - root->entries);
+
+        root->levels = *levels = 1;
+        root->count = 1;
+        root->entries[0].hash = 0;
+        root->entries[0].block = root->blocks++;
+        frames[0].at = root->entries;
+
+        assoofs_dirty_metadata(sb, bh);
+        assoofs_dirty_metadata(sb, frames[0].bh);
+        return 0;
+    }
+
+    /** 2. El nodo intermedio esta lleno: lo parto en dos si la raiz tiene sitio **/
+    if (root->count == ASSOOFS_DX_ROOT_LIMIT) {
+        printk(KERN_ERR "ERROR, El indice del directorio %lu esta lleno.\n", dir->i_ino);
+        return -ENOSPC;
+    }
+
+    aux = assoofs_journal_get_write_access(sb, frames[1].bh);
+    if (aux)
+        return aux;
+
+    bh = assoofs_dir_new_block(dir, root->blocks, &aux);
+    if (!bh)
+        return aux;
+
+    node = (struct assoofs_dx_node *)bh->b_data;
+    node->fake_rec_len = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    half = *frames[1].count / 2;
+    node->count = *frames[1].count - half;
+    memcpy(node->entries, frames[1].entries + half, node->count * sizeof(struct assoofs_dx_entry));
+    *frames[1].count = half;
+
+    assoofs_dx_insert(&frames[0], node->entries[0].hash, root->blocks++);
+    assoofs_dirty_metadata(sb, frames[0].bh);
+    assoofs_dirty_metadata(sb, frames[1].bh);
+    assoofs_dirty_metadata(sb, bh);
+
+    //Sigo por la mitad que cubre hash
+    if (frames[1].at >= frames[1].entries + half) {
+        frames[1].at = node->entries + (frames[1].at - (frames[1].entries + half));
+        brelse(frames[1].bh);
+        frames[1].bh = bh;
+        frames[1].entries = node->entries;
+        frames[1].count = &node->count;
+    }
+    else
+        brelse(bh);
+
+    return 0;
+}
+
+/******************************* Funcion assoofs_dx_map_cmp ************************************/
+static int assoofs_dx_map_cmp(const void *a, const void *b){
+
+    //DECLARACIONES
+    const struct assoofs_dx_map_entry *ma = a, *mb = b;
+
+    return ma->hash < mb->hash ? -1 : ma->hash > mb->hash;
+}
+
+/******************************* Funcion assoofs_dir_pack **************************************/
+//Copia seguidas en el bloque dst las count entradas de src indicadas en map. La ultima se alarga
+//hasta el final del bloque, de modo que el espacio libre queda junto al final
+static void assoofs_dir_pack(char *dst, const char *src, struct assoofs_dx_map_entry *map, unsigned int count){
+
+    //DECLARACIONES
+    struct assoofs_dir_record_entry *record = NULL;
+    unsigned int i, offset = 0;
+
+    memset(dst, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    for (i = 0; i < count; i++) {
+        record = (struct assoofs_dir_record_entry *)(dst + offset);
+        memcpy(record, src + map[i].offs, map[i].size);
+        record->rec_len = map[i].size;
+        offset += map[i].size;
+    }
+    record->rec_len += ASSOOFS_DEFAULT_BLOCK_SIZE - offset;
+}
+
+/******************************* Funcion assoofs_dir_remove_moved ******************************/
+//Quita de una hoja las entradas con hash >= split_hash sin mover las demas: cada una se suma a la
+//anterior, como al borrar en ext2
+static void assoofs_dir_remove_moved(char *data, uint32_t split_hash){
+
+    //DECLARACIONES
+    struct assoofs_dir_record_entry *record, *prev = NULL;
+    unsigned int offset, next;
+
+    for (offset = 0; offset < ASSOOFS_DEFAULT_BLOCK_SIZE; offset = next) {
+        record = (struct assoofs_dir_record_entry *)(data + offset);
+        next = offset + record->rec_len;
+
+        if (record->inode_no && assoofs_dx_hash(record->filename, record->name_len) >= split_hash) {
+            if (prev) {
+                prev->rec_len += record->rec_len;
+                continue;
+            }
+            record->inode_no = 0;
+        }
+        prev = record;
+    }
+}
+
+/******************************* Funcion assoofs_dx_split_leaf *********************************/
+//Reparte una hoja llena entre ella y una hoja nueva por orden de hash, mas o menos a partes iguales
+//en bytes y sin separar nombres con el mismo hash, y cuelga la nueva del indice. La hoja nueva siempre
+//es el ultimo bloque del directorio. En *leaf_bh deja la hoja que corresponde a hash
+static int assoofs_dx_split_leaf(struct inode *dir, struct assoofs_dx_frame *frames, uint32_t levels, struct buffer_head **leaf_bh, uint32_t hash){
+
+    //DECLARACIONES
+    struct super_block *sb = dir->i_sb;
+    struct assoofs_dx_root *root = (struct assoofs_dx_root *)frames[0].bh->b_data;
+    struct assoofs_dir_record_entry *record;
+    struct assoofs_dx_map_entry *map;
+    struct buffer_head *bh;
+    unsigned int offset, size, n = 0, m, half;
+    uint32_t split_hash;
+    int aux;
+
+    /** 1. Hago un mapa de las entradas en uso de la hoja ordenado por hash **/
+    map = kmalloc_array(ASSOOFS_DIR_MAX_RECORDS, sizeof(*map), GFP_KERNEL);
+    if (!map)
+        return -ENOMEM;
+
+    for (offset = 0; offset < ASSOOFS_DEFAULT_BLOCK_SIZE; offset += record->rec_len) {
+        record = assoofs_dir_entry(*leaf_bh, offset);
+        if (!record) {
+            aux = -EIO;
+            goto out;
+        }
+        if (!record->inode_no)
+            continue;
+        map[n].hash = assoofs_dx_hash(record->filename, record->name_len);
+        map[n].offs = offset;
+        map[n].size = ASSOOFS_DIR_REC_LEN(record->name_len);
+        n++;
+    }
+    sort(map, n, sizeof(*map), assoofs_dx_map_cmp, NULL);
+
+    /** 2. Elijo el punto de corte cerca de la mitad de los bytes, donde cambia el hash **/
+    for (m = 0, size = 0; m + 1 < n && size + map[m].size <= ASSOOFS_DEFAULT_BLOCK_SIZE / 2; m++)
+        size += map[m].size;
+    half = m ? m : 1;
+    for (m = half; m < n && map[m].hash == map[m - 1].hash; m++)
+        ;
+    if (m == n)
+        for (m = half; m > 0 && map[m].hash == map[m - 1].hash; m--)
+            ;
+    if (m == 0 || m == n) {
+        printk(KERN_ERR "ERROR, Demasiados nombres con el mismo hash en el directorio %lu.\n", dir->i_ino);
+        aux = -ENOSPC;
+        goto out;
+    }
+    split_hash = map[m].hash;
+
+    /** 3. Me aseguro de que el nivel que apunta a las hojas tiene sitio para la nueva. Al pasar a dos
+     **    niveles el nodo nuevo recibe la raiz entera y puede que tambien haya que partirlo **/
+    while (*frames[levels].count == frames[levels].limit) {
+        aux = assoofs_dx_grow(dir, frames, &levels, hash);
+        if (aux)
+            goto out;
+    }
+
+    /** 4. Reparto las entradas entre la hoja vieja y la nueva **/
+    aux = assoofs_journal_get_write_access(sb, frames[0].bh);
+    if (!aux && levels)
+        aux = assoofs_journal_get_write_access(sb, frames[levels].bh);
+    if (!aux)
+        aux = assoofs_journal_get_write_access(sb, *leaf_bh);
+    if (aux)
+        goto out;
+
+    bh = assoofs_dir_new_block(dir, root->blocks, &aux);
+    if (!bh)
+        goto out;
+
+    assoofs_dir_pack(bh->b_data, (*leaf_bh)->b_data, map + m, n - m);
+    assoofs_dir_remove_moved((*leaf_bh)->b_data, split_hash);
+
+    /** 5. Cuelgo la hoja nueva del indice **/
+    assoofs_dx_insert(&frames[levels], split_hash, root->blocks++);
+
+    assoofs_dirty_metadata(sb, *leaf_bh);
+    assoofs_dirty_metadata(sb, bh);
+    assoofs_dirty_metadata(sb, frames[levels].bh);
+    if (levels)
+        assoofs_dirty_metadata(sb, frames[0].bh);
+
+    if (hash >= split_hash) {
+        brelse(*leaf_bh);
+        *leaf_bh = bh;
+    }
+    else
+        brelse(bh);
+    aux = 0;
+
+out:
+    kfree(map);
+    return aux;
+}
+
+/******************************* Funcion assoofs_dir_find_space ********************************/
+//Busca en una hoja sitio para una entrada de reclen bytes: una entrada libre bastante grande o el
+//espacio que sobra detras de una entrada en uso, que se parte en dos. NULL si la hoja no tiene sitio
+static struct assoofs_dir_record_entry *assoofs_dir_find_space(struct buffer_head *bh, unsigned int reclen){
+
+    //DECLARACIONES
+    struct assoofs_dir_record_entry *record, *next;
+    unsigned int offset, used;
+
+    for (offset = 0; offset < ASSOOFS_DEFAULT_BLOCK_SIZE; offset += record->rec_len) {
+        record = assoofs_dir_entry(bh, offset);
+        if (!record)
+            return ERR_PTR(-EIO);
+
+        used = record->inode_no ? ASSOOFS_DIR_REC_LEN(record->name_len) : 0;
+        if (record->rec_len < used + reclen)
+            continue;
+
+        if (used) {
+            next = (struct assoofs_dir_record_entry *)((char *)record + used);
+            next->rec_len = record->rec_len - used;
+            next->inode_no = 0;
+            record->rec_len = used;
+            record = next;
+        }
+        return record;
+    }
+
+    return NULL;
+}
+
+/******************************* Funcion assoofs_dx_add_entry **********************************/
+//Anade al directorio dir la entrada name -> ino en la hoja que le corresponde por hash, partiendo
+//la hoja si esta llena. Devuelve -EEXIST si el nombre ya estaba. El registro de dir lo guarda quien llama.
+//El cerrojo del directorio es su i_rwsem, que el VFS coge en exclusiva para create/mkdir: las
+//altas en directorios distintos van en paralelo
+int assoofs_dx_add_entry(struct inode *dir, const char *name, unsigned int len, uint64_t ino, umode_t mode){
+
+    //DECLARACIONES
+    struct assoofs_dx_frame frames[ASSOOFS_DX_MAX_LEVELS];
+    struct assoofs_dir_record_entry *record;
+    struct buffer_head *bh;
+    uint32_t hash = assoofs_dx_hash(name, len);
+    uint32_t levels;
+    int aux;
+
+    lockdep_assert_held_write(&dir->i_rwsem);
+
+    if (len > ASSOOFS_FILENAME_MAXLEN)
+        return -ENAMETOOLONG;
+
+    aux = assoofs_dx_probe(dir, hash, frames, &levels);
+    if (aux)
+        return aux;
+
+    /** 1. Leo la hoja y compruebo que el nombre no esta ya **/
+    bh = assoofs_dir_bread(dir, frames[levels].at->block);
+    if (!bh) {
+        aux = -EIO;
+        goto out;
+    }
+
+    record = assoofs_dx_find_in_leaf(bh, name, len);
+    if (record) {
+        aux = IS_ERR(record) ? PTR_ERR(record) : -EEXIST;
+        goto out;
+    }
+
+    /** 2. Busco un hueco; si la hoja esta llena, la parto **/
+    aux = assoofs_journal_get_write_access(dir->i_sb, bh);
+    if (aux)
+        goto out;
+
+    for (;;) {
+        record = assoofs_dir_find_space(bh, ASSOOFS_DIR_REC_LEN(len));
+        if (IS_ERR(record)) {
+            aux = PTR_ERR(record);
+            goto out;
+        }
+        if (record)
+            break;
+
+        aux = assoofs_dx_split_leaf(dir, frames, levels, &bh, hash);
+        if (aux)
+            goto out;
+        levels = ((struct assoofs_dx_root *)frames[0].bh->b_data)->levels;
+    }
+
+    /** 3. Escribo la entrada **/
+    record->inode_no = ino;
+    record->name_len = len;
+    record->file_type = fs_umode_to_ftype(mode);
+    memcpy(record->filename, name, len);
+    assoofs_dirty_metadata(dir->i_sb, bh);
+
+    ASSOOFS_I(dir)->dir_children_count++;
+
+out:
+    if (bh)
+        brelse(bh);
+    assoofs_dx_release(frames);
+    return aux;
+}
+
+
+/**********************************************************************************************
+ *                            Estadisticas (/sys/fs/assoofs/<dev>)                            *
+ **********************************************************************************************/
+
+//Directorio /sys/fs/assoofs: cada montaje cuelga de el con el nombre de su dispositivo
+static struct kset *assoofs_kset;
+
+/******************************* Funcion assoofs_stat_time *************************************/
+//Apunta una llamada a op que empezo en start (ktime_get_ns)
+static void assoofs_stat_time(struct super_block *sb, enum assoofs_stat_op op, u64 start){
+    
+    //DECLARACIONES
+    struct assoofs_stats __percpu *stats = ASSOOFS_SB(sb)->s_stats;
+    u64 nsecs = ktime_get_ns() - start;
+    u64 usecs = div_u64(nsecs, NSEC_PER_USEC);
+    int bucket = usecs ? min_t(int, ilog2(usecs), ASSOOFS_LAT_BUCKETS - 1) : 0;
+    
+    this_cpu_inc(stats->op_calls[op]);
+    this_cpu_add(stats->op_nsecs[op], nsecs);
+    this_cpu_inc(stats->op_hist[op][bucket]);
+}
+
+/************************** Operaciones con medida de latencia *********************************/
+//Las tablas de operaciones apuntan aqui; cada una llama a la operacion de siempre, mide cuanto tarda
+//y deja los tracepoints de entrada y salida
+static ssize_t assoofs_timed_read(struct kiocb *iocb, struct iov_iter *to) {
+    
+    //DECLARACIONES
+    struct inode *inode = file_inode(iocb->ki_filp);
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+    
+    trace_assoofs_read_enter(inode, iocb->ki_pos, iov_iter_count(to));
+    ret = assoofs_read(iocb, to);
+    trace_assoofs_read_exit(inode, iocb->ki_pos, ret);
+    assoofs_stat_time(inode->i_sb, ASSOOFS_OP_READ, start);
+    return ret;
+}
+
+static ssize_t assoofs_timed_write(struct kiocb *iocb, struct iov_iter *from) {
+    
+    //DECLARACIONES
+    struct inode *inode = file_inode(iocb->ki_filp);
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+    
+    trace_assoofs_write_enter(inode, iocb->ki_pos, iov_iter_count(from));
+    ret = assoofs_write(iocb, from);
+    trace_assoofs_write_exit(inode, iocb->ki_pos, ret);
+    assoofs_stat_time(inode->i_sb, ASSOOFS_OP_WRITE, start);
+    return ret;
+}
+
+static struct dentry *assoofs_timed_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags) {
+    
+    //DECLARACIONES
+    u64 start = ktime_get_ns();
+    struct dentry *ret;
+    
+    trace_assoofs_lookup_enter(dir, dentry, 0);
+    ret = assoofs_lookup(dir, dentry, flags);
+    trace_assoofs_lookup_exit(dir, dentry, PTR_ERR_OR_ZERO(ret));
+    assoofs_stat_time(dir->i_sb, ASSOOFS_OP_LOOKUP, start);
+    return ret;
+}
+
+static int assoofs_timed_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
+    
+    //DECLARACIONES
+    u64 start = ktime_get_ns();
+    int ret;
+    
+    trace_assoofs_create_enter(dir, dentry, mode);
+    ret = assoofs_create(mnt_userns, dir, dentry, mode, excl);
+    trace_assoofs_create_exit(dir, dentry, ret);
+    assoofs_stat_time(dir->i_sb, ASSOOFS_OP_CREATE, start);
+    return ret;
+}
+
+static int assoofs_timed_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode) {
+    
+    //DECLARACIONES
+    u64 start = ktime_get_ns();
+    int ret;
+    
+    trace_assoofs_mkdir_enter(dir, dentry, mode);
+    ret = assoofs_mkdir(mnt_userns, dir, dentry, mode);
+    trace_assoofs_mkdir_exit(dir, dentry, ret);
+    assoofs_stat_time(dir->i_sb, ASSOOFS_OP_MKDIR, start);
+    return ret;
+}
+
+static int assoofs_timed_iterate(struct file *filp, struct dir_context *ctx) {
+    
+    //DECLARACIONES
+    struct inode *dir = file_inode(filp);
+    u64 start = ktime_get_ns();
+    int ret;
+    
+    trace_assoofs_iterate_enter(dir, ctx->pos);
+    ret = assoofs_iterate(filp, ctx);
+    trace_assoofs_iterate_exit(dir, ctx->pos, ret);
+    assoofs_stat_time(dir->i_sb, ASSOOFS_OP_ITERATE, start);
+    return ret;
+}
+
+/*********************************** Atributos de sysfs ****************************************/
+//Un valor por fichero: <suceso>, <op>_calls, <op>_nsecs (tiempo total) y <op>_latency (los cubos del
+//histograma en una linea). Escribir en reset pone todo a cero
+enum {
+    attr_event,
+    attr_calls,
+    attr_nsecs,
+    attr_latency,
+    attr_reset,
+};
+
+struct assoofs_attr {
+    struct attribute attr;
+    int attr_id;
+    int index;
+};
+
+#define ASSOOFS_ATTR(_name, _mode, _id, _index)                 \
+static struct assoofs_attr assoofs_attr_##_name = {             \
+    .attr = { .name = __stringify(_name), .mode = _mode },      \
+    .attr_id = _id,                                             \
+    .index = _index,                                            \
+}
+
+#define ASSOOFS_EVENT_ATTR(_name, _ev) ASSOOFS_ATTR(_name, 0444, attr_event, _ev)
+
+#define ASSOOFS_OP_ATTRS(_name, _op)                            \
+    ASSOOFS_ATTR(_name##_calls, 0444, attr_calls, _op);         \
+    ASSOOFS_ATTR(_name##_nsecs, 0444, attr_nsecs, _op);         \
+    ASSOOFS_ATTR(_name##_latency, 0444, attr_latency, _op)
+
+ASSOOFS_EVENT_ATTR(bread, ASSOOFS_EV_BREAD);
+ASSOOFS_EVENT_ATTR(bread_hits, ASSOOFS_EV_BREAD_HIT);
+ASSOOFS_EVENT_ATTR(sync_writes, ASSOOFS_EV_SYNC_WRITE);
+ASSOOFS_EVENT_ATTR(alloc_calls, ASSOOFS_EV_ALLOC);
+ASSOOFS_EVENT_ATTR(free_calls, ASSOOFS_EV_FREE);
+ASSOOFS_OP_ATTRS(read, ASSOOFS_OP_READ);
+ASSOOFS_OP_ATTRS(write, ASSOOFS_OP_WRITE);
+ASSOOFS_OP_ATTRS(lookup, ASSOOFS_OP_LOOKUP);
+ASSOOFS_OP_ATTRS(create, ASSOOFS_OP_CREATE);
+ASSOOFS_OP_ATTRS(iterate, ASSOOFS_OP_ITERATE);
+ASSOOFS_OP_ATTRS(mkdir, ASSOOFS_OP_MKDIR);
+ASSOOFS_ATTR(reset, 0200, attr_reset, 0);
+
+#define ATTR_LIST(name) &assoofs_attr_##name.attr
+#define ATTR_LIST_OP(name) ATTR_LIST(name##_calls), ATTR_LIST(name##_nsecs), ATTR_LIST(name##_latency)
+
+static struct attribute *assoofs_attrs[] = {
+    ATTR_LIST(bread),
+    ATTR_LIST(bread_hits),
+    ATTR_LIST(sync_writes),
+    ATTR_LIST(alloc_calls),
+    ATTR_LIST(free_calls),
+    ATTR_LIST_OP(read),
+    ATTR_LIST_OP(write),
+    ATTR_LIST_OP(lookup),
+    ATTR_LIST_OP(create),
+    ATTR_LIST_OP(iterate),
+    ATTR_LIST_OP(mkdir),
+    ATTR_LIST(reset),
+    NULL,
+};
+ATTRIBUTE_GROUPS(assoofs);
+
+//Suma las copias de todas las CPU. No es una foto exacta: las demas CPU pueden seguir sumando mientras tanto
+static ssize_t assoofs_attr_show(struct kobject *kobj, struct attribute *attr, char *buf) {
+    
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = container_of(kobj, struct assoofs_sb_info, s_kobj);
+    struct assoofs_attr *a = container_of(attr, struct assoofs_attr, attr);
+    struct assoofs_stats *stats;
+    u64 sum = 0, hist[ASSOOFS_LAT_BUCKETS] = { 0 };
+    int cpu, i, len = 0;
+    
+    for_each_possible_cpu(cpu) {
+        stats = per_cpu_ptr(sbi->s_stats, cpu);
+        switch (a->attr_id) {
+        case attr_event:
+            sum += stats->events[a->index];
+            break;
+        case attr_calls:
+            sum += stats->op_calls[a->index];
+            break;
+        case attr_nsecs:
+            sum += stats->op_nsecs[a->index];
+            break;
+        case attr_latency:
+            for (i = 0; i < ASSOOFS_LAT_BUCKETS; i++)
+                hist[i] += stats->op_hist[a->index][i];
+            break;
+        }
+    }
+    
+    if (a->attr_id != attr_latency)
+        return sysfs_emit(buf, "%llu\n", sum);
+    
+    for (i = 0; i < ASSOOFS_LAT_BUCKETS; i++)
+        len += sysfs_emit_at(buf, len, "%llu%c", hist[i], i == ASSOOFS_LAT_BUCKETS - 1 ? '\n' : ' ');
+    return len;
+}
+
+//Solo se puede escribir en reset. Lo que otra CPU sume a la vez puede perderse o quedarse
+static ssize_t assoofs_attr_store(struct kobject *kobj, struct attribute *attr, const char *buf, size_t len) {
+    
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = container_of(kobj, struct assoofs_sb_info, s_kobj);
+    struct assoofs_attr *a = container_of(attr, struct assoofs_attr, attr);
+    int cpu;
+    
+    if (a->attr_id != attr_reset)
+        return -EINVAL;
+    
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(sbi->s_stats, cpu), 0, sizeof(struct assoofs_stats));
+    return len;
+}
+
+static const struct sysfs_ops assoofs_attr_ops = {
+    .show = assoofs_attr_show,
+    .store = assoofs_attr_store,
+};
+
+//El kobject vive dentro de sbi: el desmontaje espera a que se suelte la ultima referencia
+static void assoofs_sb_release(struct kobject *kobj) {
+    
+    struct assoofs_sb_info *sbi = container_of(kobj, struct assoofs_sb_info, s_kobj);
+    
+    complete(&sbi->s_kobj_unregister);
+}
+
+static struct kobj_type assoofs_sb_ktype = {
+    .default_groups = assoofs_groups,
+    .sysfs_ops = &assoofs_attr_ops,
+    .release = assoofs_sb_release,
+};
+
+/***************************** Funcion assoofs_sysfs_register **********************************/
+static int assoofs_sysfs_register(struct super_block *sb){
+    
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    int err;
+    
+    init_completion(&sbi->s_kobj_unregister);
+    sbi->s_kobj.kset = assoofs_kset;
+    err = kobject_init_and_add(&sbi->s_kobj, &assoofs_sb_ktype, NULL, "%s", sb->s_id);
+    if (err) {
+        kobject_put(&sbi->s_kobj);
+        wait_for_completion(&sbi->s_kobj_unregister);
+    }
+    return err;
+}
+
+/**************************** Funcion assoofs_sysfs_unregister *********************************/
+static void assoofs_sysfs_unregister(struct super_block *sb){
+    
+    //DECLARACIONES
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    
+    kobject_del(&sbi->s_kobj);
+    kobject_put(&sbi->s_kobj);
+    wait_for_completion(&sbi->s_kobj_unregister);
+}
+
+
+/**********************************************************************************************
+ *                              Montaje de dispositivos assoofs                               *
+ **********************************************************************************************/
+
+static struct dentry *assoofs_mount(struct file_system_type *fs_type, int flags, const char *dev_name, void *data) {
+
+    //DECLARACIONES
+    struct dentry *ret;
+    
+    printk(KERN_INFO "\n********** Llamada a Mount **********\n");
+    printk(KERN_INFO "      MOUNT - El Sistema de Ficheros ASSOOFS se montara em %s.\n", dev_name);
+    
+    ret = mount_bdev(fs_type, flags, dev_name, data, assoofs_fill_super);
+
+    // Control de errores a partir del valor de ret. En este caso se puede utilizar la macro IS_ERR: if (IS_ERR(ret)) ...
+    if(IS_ERR(ret)) printk(KERN_ERR "Error al intentar montar ASSOOFS en %s.\n", dev_name);
+    else printk(KERN_INFO "      MOUNT - El Sistema de Ficheros ASSOOFS montado correctamente en %s.\n", dev_name);
+    
+    return ret;
+}
+
+
+/**********************************************************************************************
  *                                 assoofs file system type                                   *
  **********************************************************************************************/
 
@@ -843,24 +4256,49 @@ static struct file_system_type assoofs_type = {
     .owner   = THIS_MODULE,
     .name    = "assoofs",
     .mount   = assoofs_mount,
-    .kill_sb = kill_litter_super,
+    .kill_sb = kill_block_super,
 };
 
 extern int register_filesystem(struct file_system_type *);
 extern int unregister_filesystem(struct file_system_type *);
 
+//Constructor de la cache de inodos: el inodo del VFS se inicializa una sola vez por objeto
+static void assoofs_inode_init_once(void *foo) {
+    
+    struct assoofs_inode *ai = foo;
+    
+    init_rwsem(&ai->i_data_sem);
+    spin_lock_init(&ai->i_reserved_lock);
+    inode_init_once(&ai->vfs_inode);
+}
+
 static int __init assoofs_init(void) {
 
     //DECLARACIONES
-    int ret = register_filesystem(&assoofs_type);  
-        
-    // Control de errores a partir del valor de ret
-     if(likely(ret == 0)) printk(KERN_INFO "Sistema de Archivos ASSOOFS registrado con éxito.\n");
-    else printk(KERN_ERR "Fallo en el montaje del sistema de archivos al registrar assoofs. ERROR [%d].\n", ret);
+    int ret;
     
     //PARTE OPCIONAL
     //Inicio la cache de inodos
-    //assoofs_inode_cache = kmem_cache_create("assoofs_inode_cache", sizeof(struct assoofs_inode_info), 0, (SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD), NULL);  
+    assoofs_inode_cache = kmem_cache_create("assoofs_inode_cache", sizeof(struct assoofs_inode), 0, (SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT), assoofs_inode_init_once);
+    if (!assoofs_inode_cache)
+        return -ENOMEM;
+    
+    //Directorio de las estadisticas de cada montaje
+    assoofs_kset = kset_create_and_add("assoofs", NULL, fs_kobj);
+    if (!assoofs_kset) {
+        kmem_cache_destroy(assoofs_inode_cache);
+        return -ENOMEM;
+    }
+    
+    ret = register_filesystem(&assoofs_type);  
+        
+    // Control de errores a partir del valor de ret
+     if(likely(ret == 0)) printk(KERN_INFO "Sistema de Archivos ASSOOFS registrado con éxito.\n");
+    else {
+        printk(KERN_ERR "Fallo en el montaje del sistema de archivos al registrar assoofs. ERROR [%d].\n", ret);
+        kset_unregister(assoofs_kset);
+        kmem_cache_destroy(assoofs_inode_cache);
+    }
 
     return ret;
 }
@@ -875,8 +4313,10 @@ static void __exit assoofs_exit(void) {
     else printk(KERN_ERR "Fallo en el desmontaje del sistema de archivos (Elminimacion de registro). ERROR [%d].\n", ret);
     
     //PARTE OPCIONAL
-    //Libero la cache cuando descargue el modulo del kernel
-    //kmem_cache_destroy(assoofs_inode_cache);
+    //Libero la cache cuando descargue el modulo del kernel, una vez liberados los inodos pendientes de RCU
+    rcu_barrier();
+    kmem_cache_destroy(assoofs_inode_cache);
+    kset_unregister(assoofs_kset);
     
 }
 
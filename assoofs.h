@@ -1,39 +1,189 @@
+#ifndef ASSOOFS_H
+#define ASSOOFS_H
+
+/* Formato en disco de assoofs. Lo comparten el modulo, mkassoofs y libassoofs; fuera del kernel los
+ * tipos vienen de la libc */
+#ifndef __KERNEL__
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#endif
+
 #define ASSOOFS_MAGIC 0x20190416
+#define ASSOOFS_VERSION 10
 #define ASSOOFS_DEFAULT_BLOCK_SIZE 4096
 #define ASSOOFS_FILENAME_MAXLEN 255
 #define ASSOOFS_START_INO 10
 #define ASSOOFS_RESERVED_INODES 3 
-#define ASSOOFS_LAST_RESERVED_BLOCK ASSOOFS_ROOTDIR_DATABLOCK_NUMBER
 #define ASSOOFS_LAST_RESERVED_INODE ASSOOFS_INODESTORE_BLOCK_NUMBER
-const int ASSOOFS_SUPERBLOCK_BLOCK_NUMBER = 0;
-const int ASSOOFS_INODESTORE_BLOCK_NUMBER = 1;
-const int ASSOOFS_ROOTDIR_DATABLOCK_NUMBER = 2;
-const int ASSOOFS_ROOTDIR_INODE_NUMBER = 1;
-const int ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED = 64;
-
-//static struct kmem_cache *assoofs_inode_cache;
+#define ASSOOFS_SUPERBLOCK_BLOCK_NUMBER 0
+#define ASSOOFS_INODESTORE_BLOCK_NUMBER 1
+#define ASSOOFS_ROOTDIR_INODE_NUMBER 1
+#define ASSOOFS_INLINE_EXTENTS 6
+/* Cada bloque del mapa de bits cubre un grupo de bloques (un bit por bloque, 1 = ocupado) */
+#define ASSOOFS_BLOCKS_PER_GROUP (ASSOOFS_DEFAULT_BLOCK_SIZE * 8)
 
 struct assoofs_super_block_info {
     uint64_t version;
     uint64_t magic;
     uint64_t block_size;    
     uint64_t inodes_count;
-    uint64_t free_blocks;
-    char padding[4056];
+    uint64_t blocks_count;          /* bloques del dispositivo */
+    uint64_t inode_table_block;     /* primer bloque de la tabla de inodos */
+    uint64_t inode_table_blocks;    /* bloques que ocupa la tabla de inodos */
+    uint64_t bitmap_block;          /* primer bloque del mapa de bits de bloques */
+    uint64_t bitmap_blocks;         /* bloques del mapa de bits, uno por grupo */
+    uint64_t journal_block;         /* primer bloque del journal de metadatos */
+    uint64_t journal_blocks;        /* bloques del journal; 0 si se formateo sin journal */
+    uint64_t free_blocks;           /* bloques libres; solo es fiable con ASSOOFS_STATE_CLEAN */
+    uint64_t state;                 /* ASSOOFS_STATE_* */
+    uint64_t reserved_blocks;       /* bloques que solo se dan a procesos con CAP_SYS_RESOURCE */
+    char padding[3984];
 };
 
+/* El sistema se desmonto bien: free_blocks coincide con el mapa de bits y al montar no hace falta
+ * recorrerlo. Se borra al montar y se vuelve a poner al desmontar */
+#define ASSOOFS_STATE_CLEAN 0x0001
+
+/* El journal es una region de bloques contiguos con el formato de jbd2 (su primer bloque es el
+ * superbloque del journal). jbd2 no acepta journals de menos de 1024 bloques */
+#define ASSOOFS_MIN_JOURNAL_BLOCKS 1024
+
+/* Entrada de directorio de longitud variable (al estilo de ext2). Las entradas de un bloque se
+ * encadenan con rec_len hasta cubrirlo entero; una entrada con inode_no = 0 es espacio libre. El
+ * nombre no lleva '\0' final */
 struct assoofs_dir_record_entry {
-    char filename[ASSOOFS_FILENAME_MAXLEN];
     uint64_t inode_no;
+    uint16_t rec_len;       /* bytes desde esta entrada hasta la siguiente */
+    uint8_t name_len;
+    uint8_t file_type;      /* ASSOOFS_FT_*, para rellenar d_type sin leer el inodo */
+    char filename[];
+};
+
+/* Tipos de fichero en las entradas de directorio: los mismos valores que FT_* de <linux/fs_types.h> */
+#define ASSOOFS_FT_UNKNOWN 0
+#define ASSOOFS_FT_REG_FILE 1
+#define ASSOOFS_FT_DIR 2
+
+#define ASSOOFS_DIR_PAD 8
+#define ASSOOFS_DIR_REC_LEN(name_len) (((name_len) + offsetof(struct assoofs_dir_record_entry, filename) + ASSOOFS_DIR_PAD - 1) & ~(ASSOOFS_DIR_PAD - 1))
+#define ASSOOFS_DIR_MAX_RECORDS (ASSOOFS_DEFAULT_BLOCK_SIZE / ASSOOFS_DIR_REC_LEN(1))
+
+/* Comprueba que la entrada que empieza en offset dentro de un bloque de directorio esta bien
+ * encadenada: cabe en el bloque, rec_len es multiplo de ASSOOFS_DIR_PAD y alcanza para el nombre */
+static inline int assoofs_dir_rec_valid(const void *block, unsigned int offset) {
+    const struct assoofs_dir_record_entry *record = (const struct assoofs_dir_record_entry *)((const char *)block + offset);
+
+    return offset + ASSOOFS_DIR_REC_LEN(0) <= ASSOOFS_DEFAULT_BLOCK_SIZE && record->rec_len >= ASSOOFS_DIR_REC_LEN(0) &&
+           !(record->rec_len % ASSOOFS_DIR_PAD) && offset + record->rec_len <= ASSOOFS_DEFAULT_BLOCK_SIZE &&
+           ASSOOFS_DIR_REC_LEN(record->name_len) <= record->rec_len;
+}
+
+/* Indice de directorio (htree). El bloque logico 0 de cada directorio es la raiz del indice:
+ * sus entradas, ordenadas por hash, apuntan a las hojas (levels = 0) o a nodos intermedios
+ * (levels = 1) que a su vez apuntan a las hojas. Las hojas guardan los registros del directorio
+ * (inode_no = 0 es un hueco) y todos los nombres con el mismo hash caen en la misma hoja */
+#define ASSOOFS_DX_MAGIC 0x45525448     /* "HTRE" */
+#define ASSOOFS_DX_MAX_LEVELS 2
+
+struct assoofs_dx_entry {
+    uint32_t hash;      /* menor hash de los nombres que cuelgan de block */
+    uint32_t block;     /* bloque logico dentro del directorio */
+};
+
+struct assoofs_dx_root {
+    uint32_t magic;
+    uint32_t levels;
+    uint32_t count;
+    uint32_t blocks;    /* bloques logicos que ocupa el directorio */
+    struct assoofs_dx_entry entries[(ASSOOFS_DEFAULT_BLOCK_SIZE - 4 * sizeof(uint32_t)) / sizeof(struct assoofs_dx_entry)];
+};
+
+/* Los nodos intermedios empiezan como una entrada de directorio libre que ocupa todo el bloque, de
+ * modo que al recorrer los bloques del directorio uno tras otro (libassoofs) se ven como hojas vacias */
+struct assoofs_dx_node {
+    uint64_t fake_inode_no;
+    uint16_t fake_rec_len;
+    uint8_t fake_name_len;
+    uint8_t fake_file_type;
+    uint32_t count;
+    struct assoofs_dx_entry entries[(ASSOOFS_DEFAULT_BLOCK_SIZE - 2 * sizeof(uint64_t)) / sizeof(struct assoofs_dx_entry)];
 };
 
+#define ASSOOFS_DX_ROOT_LIMIT (sizeof(((struct assoofs_dx_root *)0)->entries) / sizeof(struct assoofs_dx_entry))
+#define ASSOOFS_DX_NODE_LIMIT (sizeof(((struct assoofs_dx_node *)0)->entries) / sizeof(struct assoofs_dx_entry))
+
+/* Hash de los nombres en el indice (FNV-1a de 32 bits); lo usan el modulo y mkassoofs */
+static inline uint32_t assoofs_dx_hash(const char *name, unsigned int len) {
+    uint32_t hash = 2166136261u;
+
+    while (len--) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Busca (binaria) la ultima entrada del indice cuyo hash es <= hash. La primera entrada cubre desde 0 */
+static inline struct assoofs_dx_entry *assoofs_dx_search(struct assoofs_dx_entry *entries, uint32_t count, uint32_t hash) {
+    uint32_t lo = 1, hi = count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (entries[mid].hash > hash)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return &entries[lo - 1];
+}
+
+/* Tramo de bloques contiguos: ee_len bloques fisicos a partir de ee_start
+ * que contienen los bloques logicos [ee_block, ee_block + ee_len) */
+struct assoofs_extent {
+    uint32_t ee_block;
+    uint32_t ee_len;
+    uint64_t ee_start;
+};
+
+/* Los primeros ASSOOFS_INLINE_EXTENTS tramos van dentro del registro del
+ * inodo; el resto se guarda en un bloque de extents aparte */
+struct assoofs_extent_block {
+    uint64_t eb_count;
+    struct assoofs_extent eb_extents[(ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(uint64_t)) / sizeof(struct assoofs_extent)];
+};
+
+#define ASSOOFS_EXTENTS_PER_BLOCK (sizeof(((struct assoofs_extent_block *)0)->eb_extents) / sizeof(struct assoofs_extent))
+#define ASSOOFS_MAX_EXTENTS (ASSOOFS_INLINE_EXTENTS + ASSOOFS_EXTENTS_PER_BLOCK)
+
+/* Registro de 128 bytes en la tabla de inodos. El inodo inode_no ocupa la
+ * posicion inode_no de la tabla, de modo que su bloque se calcula directamente
+ * (ver ASSOOFS_INODE_BLOCK) */
 struct assoofs_inode_info {
     mode_t mode;
+    uint16_t extents_count;
+    uint16_t flags;         /* ASSOOFS_INODE_* */
     uint64_t inode_no;
-    uint64_t data_block_number;
-    char campo_nuevo;
+    uint64_t extent_block;
     union {
         uint64_t file_size;
         uint64_t dir_children_count;
     };
+    union {
+        struct assoofs_extent extents[ASSOOFS_INLINE_EXTENTS];
+        char inline_data[ASSOOFS_INLINE_EXTENTS * sizeof(struct assoofs_extent)];
+    };
 };
+
+/* Los ficheros de hasta ASSOOFS_INLINE_DATA_MAX bytes guardan su contenido en el propio registro,
+ * en el sitio de los extents, y no tienen bloques de datos (extents_count = 0). Al crecer por
+ * encima del limite el contenido pasa a un bloque y el inodo pierde la marca */
+#define ASSOOFS_INODE_INLINE_DATA 0x0001
+#define ASSOOFS_INLINE_DATA_MAX (sizeof(((struct assoofs_inode_info *)0)->inline_data))
+
+#define ASSOOFS_INODES_PER_BLOCK (ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_inode_info))
+#define ASSOOFS_INODE_BLOCK(asb, ino) ((asb)->inode_table_block + (ino) / ASSOOFS_INODES_PER_BLOCK)
+#define ASSOOFS_INODE_OFFSET(ino) ((ino) % ASSOOFS_INODES_PER_BLOCK)
+
+#endif /* ASSOOFS_H */
@@ -0,0 +1,269 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+//Tracepoints de assoofs. Sin nadie escuchando cuestan un salto; con perf o bpftrace se activan en
+//un montaje en marcha:
+//
+//	perf record -e 'assoofs:*' -a
+//	bpftrace -e 'tracepoint:assoofs:assoofs_write_exit { @[args->ret > 0] = count(); }'
+//
+//Las operaciones del VFS tienen un evento de entrada y otro de salida (con el resultado); el
+//reparto de bloques y las funciones de la tabla de inodos, uno al terminar
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM assoofs
+
+#if !defined(_ASSOOFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ASSOOFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/******************************* Lectura y escritura *******************************/
+DECLARE_EVENT_CLASS(assoofs_rw_enter_class,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t count),
+    TP_ARGS(inode, pos, count),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, ino)
+        __field(loff_t, pos)
+        __field(size_t, count)
+    ),
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->pos = pos;
+        __entry->count = count;
+    ),
+    TP_printk("dev %d,%d ino %lu pos %lld count %zu",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->ino,
+        __entry->pos, __entry->count)
+);
+
+DEFINE_EVENT(assoofs_rw_enter_class, assoofs_read_enter,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t count),
+    TP_ARGS(inode, pos, count));
+
+DEFINE_EVENT(assoofs_rw_enter_class, assoofs_write_enter,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t count),
+    TP_ARGS(inode, pos, count));
+
+DECLARE_EVENT_CLASS(assoofs_rw_exit_class,
+    TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret),
+    TP_ARGS(inode, pos, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, ino)
+        __field(loff_t, pos)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->pos = pos;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev %d,%d ino %lu pos %lld ret %zd",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->ino,
+        __entry->pos, __entry->ret)
+);
+
+DEFINE_EVENT(assoofs_rw_exit_class, assoofs_read_exit,
+    TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret),
+    TP_ARGS(inode, pos, ret));
+
+DEFINE_EVENT(assoofs_rw_exit_class, assoofs_write_exit,
+    TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret),
+    TP_ARGS(inode, pos, ret));
+
+/******************************* Listado de directorios *******************************/
+TRACE_EVENT(assoofs_iterate_enter,
+    TP_PROTO(struct inode *dir, loff_t pos),
+    TP_ARGS(dir, pos),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, dir)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->pos = pos;
+    ),
+    TP_printk("dev %d,%d dir %lu pos %lld",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->dir, __entry->pos)
+);
+
+TRACE_EVENT(assoofs_iterate_exit,
+    TP_PROTO(struct inode *dir, loff_t pos, int ret),
+    TP_ARGS(dir, pos, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, dir)
+        __field(loff_t, pos)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->pos = pos;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev %d,%d dir %lu pos %lld ret %d",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->dir,
+        __entry->pos, __entry->ret)
+);
+
+/******************************* Busqueda y creacion de nombres *******************************/
+DECLARE_EVENT_CLASS(assoofs_namei_enter_class,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, umode_t mode),
+    TP_ARGS(dir, dentry, mode),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, dir)
+        __field(umode_t, mode)
+        __string(name, dentry->d_name.name)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->mode = mode;
+        __assign_str(name, dentry->d_name.name);
+    ),
+    TP_printk("dev %d,%d dir %lu name %s mode 0%o",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->dir,
+        __get_str(name), __entry->mode)
+);
+
+DEFINE_EVENT(assoofs_namei_enter_class, assoofs_lookup_enter,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, umode_t mode),
+    TP_ARGS(dir, dentry, mode));
+
+DEFINE_EVENT(assoofs_namei_enter_class, assoofs_create_enter,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, umode_t mode),
+    TP_ARGS(dir, dentry, mode));
+
+DEFINE_EVENT(assoofs_namei_enter_class, assoofs_mkdir_enter,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, umode_t mode),
+    TP_ARGS(dir, dentry, mode));
+
+//ino es el inodo encontrado o creado (0 si no hay)
+DECLARE_EVENT_CLASS(assoofs_namei_exit_class,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int ret),
+    TP_ARGS(dir, dentry, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, dir)
+        __field(ino_t, ino)
+        __field(int, ret)
+        __string(name, dentry->d_name.name)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->ino = d_really_is_positive(dentry) ? d_inode(dentry)->i_ino : 0;
+        __entry->ret = ret;
+        __assign_str(name, dentry->d_name.name);
+    ),
+    TP_printk("dev %d,%d dir %lu name %s ino %lu ret %d",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->dir,
+        __get_str(name), (unsigned long)__entry->ino, __entry->ret)
+);
+
+DEFINE_EVENT(assoofs_namei_exit_class, assoofs_lookup_exit,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int ret),
+    TP_ARGS(dir, dentry, ret));
+
+DEFINE_EVENT(assoofs_namei_exit_class, assoofs_create_exit,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int ret),
+    TP_ARGS(dir, dentry, ret));
+
+DEFINE_EVENT(assoofs_namei_exit_class, assoofs_mkdir_exit,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int ret),
+    TP_ARGS(dir, dentry, ret));
+
+/******************************* Mapa de bits de bloques *******************************/
+TRACE_EVENT(assoofs_new_blocks,
+    TP_PROTO(struct super_block *sb, u64 goal, u32 wanted, u64 block, u32 count, int ret),
+    TP_ARGS(sb, goal, wanted, block, count, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u64, goal)
+        __field(u32, wanted)
+        __field(u64, block)
+        __field(u32, count)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->goal = goal;
+        __entry->wanted = wanted;
+        __entry->block = block;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev %d,%d goal %llu wanted %u block %llu count %u ret %d",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->goal, __entry->wanted,
+        __entry->block, __entry->count, __entry->ret)
+);
+
+TRACE_EVENT(assoofs_free_blocks,
+    TP_PROTO(struct super_block *sb, u64 block, u32 count, u32 freed),
+    TP_ARGS(sb, block, count, freed),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u64, block)
+        __field(u32, count)
+        __field(u32, freed)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->block = block;
+        __entry->count = count;
+        __entry->freed = freed;
+    ),
+    TP_printk("dev %d,%d block %llu count %u freed %u",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->block, __entry->count, __entry->freed)
+);
+
+/******************************* Tabla de inodos *******************************/
+//block es el bloque de la tabla de inodos que guarda el registro de ino
+DECLARE_EVENT_CLASS(assoofs_inode_store_class,
+    TP_PROTO(struct super_block *sb, u64 ino, int ret),
+    TP_ARGS(sb, ino, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u64, ino)
+        __field(u64, block)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->ino = ino;
+        __entry->block = ASSOOFS_INODE_BLOCK(ASSOOFS_SB(sb)->s_asb, ino);
+        __entry->ret = ret;
+    ),
+    TP_printk("dev %d,%d ino %llu block %llu ret %d",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->block, __entry->ret)
+);
+
+DEFINE_EVENT(assoofs_inode_store_class, assoofs_get_inode_info,
+    TP_PROTO(struct super_block *sb, u64 ino, int ret),
+    TP_ARGS(sb, ino, ret));
+
+DEFINE_EVENT(assoofs_inode_store_class, assoofs_save_inode_info,
+    TP_PROTO(struct super_block *sb, u64 ino, int ret),
+    TP_ARGS(sb, ino, ret));
+
+DEFINE_EVENT(assoofs_inode_store_class, assoofs_add_inode_info,
+    TP_PROTO(struct super_block *sb, u64 ino, int ret),
+    TP_ARGS(sb, ino, ret));
+
+DEFINE_EVENT(assoofs_inode_store_class, assoofs_new_inode_no,
+    TP_PROTO(struct super_block *sb, u64 ino, int ret),
+    TP_ARGS(sb, ino, ret));
+
+#endif /* _ASSOOFS_TRACE_H */
+
+//La cabecera no esta en include/trace/events: define_trace.h tiene que buscarla en este directorio
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE assoofs_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Benchmark de assoofs: formatea una imagen nueva, la monta en un loop y pasa benchassoofs.
+# Hace falta ser root. La salida es un objeto JSON por linea (el primero dice de que commit y
+# kernel son los resultados); los avisos van a stderr.
+#
+#	make bench                                  todo por defecto
+#	BENCH_ARGS="-n 50000 -t 8" make bench       parametros de benchassoofs
+#	BENCH_SIZE=8G BENCH_IMG=/ssd/img make bench imagen en otro disco
+set -e
+
+IMG=${BENCH_IMG:-/tmp/assoofs-bench.img}
+MNT=${BENCH_MNT:-/tmp/assoofs-bench.mnt}
+SIZE=${BENCH_SIZE:-2G}
+LOOP=
+LOADED=
+
+cleanup() {
+	mountpoint -q "$MNT" && umount "$MNT"
+	[ -n "$LOOP" ] && losetup -d "$LOOP"
+	[ -n "$LOADED" ] && rmmod assoofs
+	rm -f "$IMG"
+}
+trap cleanup EXIT
+
+# benchassoofs crea -n ficheros en create/ y otros tantos en parallel/: la tabla de inodos tiene
+# que tenerlos todos, ademas de los directorios y el fichero de datos, sea cual sea el tamaño
+FILES=10000
+set -- $BENCH_ARGS
+while [ $# -gt 0 ]; do
+	case $1 in
+	-n) FILES=${2:-$FILES}; [ $# -gt 1 ] && shift ;;
+	-n*) FILES=${1#-n} ;;
+	esac
+	shift
+done
+
+# Siempre una imagen recien hecha, para que dos ejecuciones partan del mismo estado
+rm -f "$IMG"
+./mkassoofs -s "$SIZE" -N $((2 * FILES + 64)) "$IMG" >&2
+
+if ! grep -q '^assoofs ' /proc/modules; then
+	insmod ./assoofs.ko
+	LOADED=1
+fi
+
+LOOP=$(losetup -f --show "$IMG")
+mkdir -p "$MNT"
+mount -t assoofs "$LOOP" "$MNT"
+
+# Sin cache de paginas caliente de ejecuciones anteriores
+sync
+echo 3 > /proc/sys/vm/drop_caches
+
+printf '{"commit":"%s","kernel":"%s","image_size":"%s"}\n' \
+	"$(git describe --always --dirty 2>/dev/null || echo unknown)" "$(uname -r)" "$SIZE"
+./benchassoofs $BENCH_ARGS "$MNT"
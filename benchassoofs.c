@@ -0,0 +1,330 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Fixed set of workloads against a mounted assoofs, always run in the same order with the same
+ * seeds so two runs (two commits) can be compared. Every workload prints one JSON object per line
+ * with its throughput and latency percentiles; each op is timed on its own.
+ */
+#define MAX_THREADS 64
+#define MAX_IO_SIZE (1 << 20)
+
+static const char *mnt;
+static uint64_t nfiles = 10000;         /* -n: files created, and entries of the big directory */
+static int nthreads = 4;                /* -t: threads of the stat storm and the parallel creators */
+static uint64_t file_size = 256 << 20;  /* -s: file of the sequential and random I/O workloads */
+static uint64_t random_ops = 10000;     /* -r */
+static uint64_t stat_ops = 100000;      /* -S */
+static uint64_t readdir_ops = 20;       /* -R: full listings of the big directory */
+
+/* State shared by the ops of the running workload */
+static int fd;
+static size_t io_size;
+static unsigned char *io_buf;
+
+struct job {
+    int (*op)(struct job *j, uint64_t i);
+    uint64_t first, count;
+    uint64_t *lat;              /* nanoseconds, one per op */
+    unsigned int seed;
+    int err;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *worker(void *arg) {
+    struct job *j = arg;
+    uint64_t i, t;
+
+    for (i = 0; i < j->count; i++) {
+        t = now_ns();
+        if (j->op(j, j->first + i)) {
+            j->err = errno;
+            break;
+        }
+        j->lat[i] = now_ns() - t;
+    }
+    return NULL;
+}
+
+static int u64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *lat, uint64_t n, double p) {
+    return lat[(uint64_t)((n - 1) * p)] / 1000.0;
+}
+
+/*
+ * Runs nops ops split among threads and prints the result. finish (fsync, say) runs after the ops
+ * and counts in the elapsed time but not in the latencies.
+ */
+static int run(const char *name, int (*op)(struct job *, uint64_t), uint64_t nops, int threads, int (*finish)(void)) {
+    pthread_t tids[MAX_THREADS];
+    struct job jobs[MAX_THREADS];
+    uint64_t *lat, start, elapsed, per = nops / threads;
+    int i, err = 0;
+
+    lat = malloc(nops * sizeof(*lat));
+    if (!lat) {
+        fprintf(stderr, "%s: out of memory\n", name);
+        return -1;
+    }
+
+    start = now_ns();
+    for (i = 0; i < threads; i++) {
+        jobs[i] = (struct job) {
+            .op = op,
+            .first = i * per,
+            .count = i == threads - 1 ? nops - i * per : per,
+            .lat = lat + i * per,
+            .seed = i + 1,
+        };
+        if (pthread_create(&tids[i], NULL, worker, &jobs[i])) {
+            threads = i;
+            err = EAGAIN;
+            break;
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        if (jobs[i].err)
+            err = jobs[i].err;
+    }
+    if (!err && finish && finish())
+        err = errno;
+    elapsed = now_ns() - start;
+
+    if (err) {
+        fprintf(stderr, "%s: %s\n", name, strerror(err));
+        free(lat);
+        return -1;
+    }
+
+    qsort(lat, nops, sizeof(*lat), u64_cmp);
+    printf("{\"workload\":\"%s\",\"threads\":%d,\"io_size\":%zu,\"ops\":%llu,\"secs\":%.6f,\"ops_per_sec\":%.1f,"
+           "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+           name, threads, io_size, (unsigned long long)nops, elapsed / 1e9, nops * 1e9 / elapsed,
+           percentile_us(lat, nops, 0.5), percentile_us(lat, nops, 0.9), percentile_us(lat, nops, 0.99),
+           percentile_us(lat, nops, 0.999), lat[nops - 1] / 1000.0);
+    fflush(stdout);
+
+    free(lat);
+    return 0;
+}
+
+static int create_in(const char *dir, uint64_t i) {
+    char path[4096];
+    int f;
+
+    snprintf(path, sizeof(path), "%s/%s/f%llu", mnt, dir, (unsigned long long)i);
+    f = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (f == -1)
+        return -1;
+    return close(f);
+}
+
+static int op_create(struct job *j, uint64_t i) {
+    (void)j;
+    return create_in("create", i);
+}
+
+static int op_parallel_create(struct job *j, uint64_t i) {
+    (void)j;
+    return create_in("parallel", i);
+}
+
+static int op_stat(struct job *j, uint64_t i) {
+    char path[4096];
+    struct stat st;
+
+    (void)i;
+    snprintf(path, sizeof(path), "%s/create/f%llu", mnt, (unsigned long long)(rand_r(&j->seed) % nfiles));
+    return stat(path, &st);
+}
+
+static int op_readdir(struct job *j, uint64_t i) {
+    char path[4096];
+    struct dirent *de;
+    uint64_t entries = 0;
+    DIR *d;
+
+    (void)j;
+    (void)i;
+    snprintf(path, sizeof(path), "%s/create", mnt);
+    d = opendir(path);
+    if (!d)
+        return -1;
+    while ((de = readdir(d)))
+        entries++;
+    closedir(d);
+
+    /* Every file plus . and .. */
+    if (entries != nfiles + 2) {
+        errno = EUCLEAN;
+        return -1;
+    }
+    return 0;
+}
+
+static int op_seq_write(struct job *j, uint64_t i) {
+    (void)j;
+    (void)i;
+    return write(fd, io_buf, io_size) == (ssize_t)io_size ? 0 : -1;
+}
+
+static int op_seq_read(struct job *j, uint64_t i) {
+    (void)j;
+    (void)i;
+    return read(fd, io_buf, io_size) == (ssize_t)io_size ? 0 : -1;
+}
+
+static off_t random_offset(struct job *j) {
+    return (off_t)(rand_r(&j->seed) % (file_size / io_size)) * io_size;
+}
+
+static int op_random_read(struct job *j, uint64_t i) {
+    (void)i;
+    return pread(fd, io_buf, io_size, random_offset(j)) == (ssize_t)io_size ? 0 : -1;
+}
+
+static int op_random_write(struct job *j, uint64_t i) {
+    (void)i;
+    return pwrite(fd, io_buf, io_size, random_offset(j)) == (ssize_t)io_size ? 0 : -1;
+}
+
+static int finish_fsync(void) {
+    return fsync(fd);
+}
+
+/* Opens the data file at offset 0 with its pages dropped, so reads come from the device */
+static int open_data(int flags, size_t size) {
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s/data", mnt);
+    fd = open(path, flags, 0644);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    io_size = size;
+    return 0;
+}
+
+static int make_dir(const char *name) {
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s/%s", mnt, name);
+    if (mkdir(path, 0755) == -1) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(void) {
+    printf("Usage: benchassoofs [-n files] [-t threads] [-s file_size_mb] [-r random_ops] [-S stat_ops] [-R readdirs] <mountpoint>\n");
+    printf("  The mountpoint must hold a freshly made, empty assoofs.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t seq_sizes[] = { 4096, 65536, MAX_IO_SIZE };
+    static const size_t random_sizes[] = { 4096, 65536 };
+    char name[64];
+    unsigned int i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:s:r:S:R:")) != -1) {
+        switch (opt) {
+        case 'n': nfiles = strtoull(optarg, NULL, 0); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 's': file_size = strtoull(optarg, NULL, 0) << 20; break;
+        case 'r': random_ops = strtoull(optarg, NULL, 0); break;
+        case 'S': stat_ops = strtoull(optarg, NULL, 0); break;
+        case 'R': readdir_ops = strtoull(optarg, NULL, 0); break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || !nfiles || nthreads < 1 || nthreads > MAX_THREADS || file_size < MAX_IO_SIZE ||
+        !random_ops || !stat_ops || !readdir_ops) {
+        usage();
+        return 1;
+    }
+    mnt = argv[optind];
+
+    io_buf = aligned_alloc(4096, MAX_IO_SIZE);
+    if (!io_buf)
+        return 1;
+    memset(io_buf, 0xa5, MAX_IO_SIZE);
+    file_size -= file_size % MAX_IO_SIZE;
+
+    printf("{\"benchmark\":\"assoofs\",\"files\":%llu,\"threads\":%d,\"file_size\":%llu,\"random_ops\":%llu,\"stat_ops\":%llu,\"readdirs\":%llu}\n",
+           (unsigned long long)nfiles, nthreads, (unsigned long long)file_size, (unsigned long long)random_ops,
+           (unsigned long long)stat_ops, (unsigned long long)readdir_ops);
+
+    /* Metadata: one big directory, then a storm of lookups and listings over it */
+    if (make_dir("create") || run("create", op_create, nfiles, 1, NULL))
+        return 1;
+    if (run("stat", op_stat, stat_ops, nthreads, NULL))
+        return 1;
+    if (run("readdir", op_readdir, readdir_ops, 1, NULL))
+        return 1;
+    if (make_dir("parallel") || run("parallel_create", op_parallel_create, nfiles, nthreads, NULL))
+        return 1;
+
+    /* Data: the first pass lays the file out, the later ones overwrite it in place */
+    for (i = 0; i < sizeof(seq_sizes) / sizeof(seq_sizes[0]); i++) {
+        if (open_data(O_CREAT | O_WRONLY, seq_sizes[i]))
+            return 1;
+        snprintf(name, sizeof(name), "seq_write_%zuk", seq_sizes[i] / 1024);
+        if (run(name, op_seq_write, file_size / io_size, 1, finish_fsync))
+            return 1;
+        close(fd);
+
+        if (open_data(O_RDONLY, seq_sizes[i]))
+            return 1;
+        snprintf(name, sizeof(name), "seq_read_%zuk", seq_sizes[i] / 1024);
+        if (run(name, op_seq_read, file_size / io_size, 1, NULL))
+            return 1;
+        close(fd);
+    }
+
+    for (i = 0; i < sizeof(random_sizes) / sizeof(random_sizes[0]); i++) {
+        if (open_data(O_RDONLY, random_sizes[i]))
+            return 1;
+        snprintf(name, sizeof(name), "random_read_%zuk", random_sizes[i] / 1024);
+        if (run(name, op_random_read, random_ops, nthreads, NULL))
+            return 1;
+        close(fd);
+
+        if (open_data(O_WRONLY, random_sizes[i]))
+            return 1;
+        snprintf(name, sizeof(name), "random_write_%zuk", random_sizes[i] / 1024);
+        if (run(name, op_random_write, random_ops, nthreads, finish_fsync))
+            return 1;
+        close(fd);
+    }
+
+    free(io_buf);
+    return 0;
+}
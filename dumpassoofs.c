@@ -0,0 +1,165 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "libassoofs.h"
+
+static void usage(void) {
+    printf("Usage: dumpassoofs <image> <command> [path]\n");
+    printf("  super        superblock fields\n");
+    printf("  ls [dir]     entries of a directory (default /): inode, type, size (entries for a directory) and name\n");
+    printf("  cat <file>   file contents on standard output\n");
+    printf("  stat <path>  inode record\n");
+    printf("  map <path>   block map: the extents of the inode\n");
+}
+
+static int cmd_super(const struct assoofs_image *img) {
+    const struct assoofs_super_block_info *sb = img->sb;
+
+    printf("version %llu\nblock_size %llu\ninodes_count %llu\nblocks_count %llu\n",
+           (unsigned long long)sb->version, (unsigned long long)sb->block_size,
+           (unsigned long long)sb->inodes_count, (unsigned long long)sb->blocks_count);
+    printf("inode_table %llu+%llu\nbitmap %llu+%llu\njournal %llu+%llu\n",
+           (unsigned long long)sb->inode_table_block, (unsigned long long)sb->inode_table_blocks,
+           (unsigned long long)sb->bitmap_block, (unsigned long long)sb->bitmap_blocks,
+           (unsigned long long)sb->journal_block, (unsigned long long)sb->journal_blocks);
+    printf("free_blocks %llu\nreserved_blocks %llu\nstate %s\n",
+           (unsigned long long)sb->free_blocks, (unsigned long long)sb->reserved_blocks,
+           sb->state & ASSOOFS_STATE_CLEAN ? "clean" : "not clean");
+    return 0;
+}
+
+static int cmd_ls(const struct assoofs_image *img, const struct assoofs_inode_info *dir) {
+    const struct assoofs_dir_record_entry *record;
+    const struct assoofs_inode_info *inode;
+    struct assoofs_dir_pos pos = { 0, 0 };
+    int ret;
+
+    while ((ret = assoofs_dir_next(img, dir, &pos, &record)) == 1) {
+        inode = assoofs_inode(img, record->inode_no);
+        printf("%8llu %c %12llu %.*s\n", (unsigned long long)record->inode_no,
+               record->file_type == ASSOOFS_FT_DIR ? 'd' : '-',
+               inode ? (unsigned long long)inode->file_size : 0ULL,
+               record->name_len, record->filename);
+    }
+    return ret;
+}
+
+static int cmd_cat(const struct assoofs_image *img, const struct assoofs_inode_info *inode) {
+    static const char zeros[ASSOOFS_DEFAULT_BLOCK_SIZE];
+    const void *data;
+    uint64_t off = 0, len, chunk;
+    ssize_t written;
+    int ret;
+
+    if (S_ISDIR(inode->mode))
+        return -EISDIR;
+
+    /* Straight from the mapping to standard output; only holes go through a buffer */
+    while (!(ret = assoofs_file_span(img, inode, off, &data, &len)) && len) {
+        for (off += len; len; len -= written) {
+            chunk = data || len < sizeof(zeros) ? len : sizeof(zeros);
+            written = write(STDOUT_FILENO, data ? data : zeros, chunk);
+            if (written <= 0)
+                return -errno;
+            if (data)
+                data = (const char *)data + written;
+        }
+    }
+    return ret;
+}
+
+static int cmd_stat(const struct assoofs_image *img, const struct assoofs_inode_info *inode) {
+    uint64_t blocks = 0;
+    uint32_t i;
+    const struct assoofs_extent *ext;
+
+    for (i = 0; i < inode->extents_count; i++) {
+        ext = assoofs_extent(img, inode, i);
+        if (!ext)
+            return -EIO;
+        blocks += ext->ee_len;
+    }
+
+    printf("inode %llu\nmode 0%o (%s)\n", (unsigned long long)inode->inode_no, (unsigned int)inode->mode,
+           S_ISDIR(inode->mode) ? "directory" : S_ISREG(inode->mode) ? "regular file" : "unknown");
+    if (S_ISDIR(inode->mode))
+        printf("children %llu\n", (unsigned long long)inode->dir_children_count);
+    else
+        printf("size %llu\n", (unsigned long long)inode->file_size);
+    printf("flags 0x%x%s\nextents %u\nblocks %llu\n", inode->flags,
+           inode->flags & ASSOOFS_INODE_INLINE_DATA ? " (inline data)" : "",
+           inode->extents_count, (unsigned long long)blocks);
+    if (inode->extents_count > ASSOOFS_INLINE_EXTENTS)
+        printf("extent_block %llu\n", (unsigned long long)inode->extent_block);
+    return 0;
+}
+
+static int cmd_map(const struct assoofs_image *img, const struct assoofs_inode_info *inode) {
+    const struct assoofs_extent *ext;
+    uint32_t i;
+
+    /* logical first block, physical first block, length */
+    for (i = 0; i < inode->extents_count; i++) {
+        ext = assoofs_extent(img, inode, i);
+        if (!ext)
+            return -EIO;
+        printf("%10u %12llu %10u\n", ext->ee_block, (unsigned long long)ext->ee_start, ext->ee_len);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct assoofs_image img;
+    const struct assoofs_inode_info *inode;
+    const char *cmd, *path;
+    uint64_t ino;
+    int ret;
+
+    if (argc < 3 || argc > 4) {
+        usage();
+        return 1;
+    }
+    cmd = argv[2];
+    path = argc == 4 ? argv[3] : "/";
+
+    ret = assoofs_open(&img, argv[1]);
+    if (ret) {
+        fprintf(stderr, "%s: %s\n", argv[1], ret == -EINVAL ? "not an assoofs image" : strerror(-ret));
+        return 1;
+    }
+
+    if (!strcmp(cmd, "super")) {
+        ret = cmd_super(&img);
+        goto out;
+    }
+
+    ret = assoofs_namei(&img, path, &ino);
+    if (!ret && !(inode = assoofs_inode(&img, ino)))
+        ret = -EIO;
+    if (ret) {
+        fprintf(stderr, "%s: %s\n", path, strerror(-ret));
+        goto out;
+    }
+
+    if (!strcmp(cmd, "ls"))
+        ret = cmd_ls(&img, inode);
+    else if (!strcmp(cmd, "cat"))
+        ret = cmd_cat(&img, inode);
+    else if (!strcmp(cmd, "stat"))
+        ret = cmd_stat(&img, inode);
+    else if (!strcmp(cmd, "map"))
+        ret = cmd_map(&img, inode);
+    else {
+        usage();
+        ret = -EINVAL;
+    }
+    if (ret && ret != -EINVAL)
+        fprintf(stderr, "%s: %s\n", path, strerror(-ret));
+
+out:
+    assoofs_close(&img);
+    return ret ? 1 : 0;
+}
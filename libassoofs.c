@@ -0,0 +1,255 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libassoofs.h"
+
+int assoofs_open(struct assoofs_image *img, const char *path) {
+    struct stat st;
+    void *base;
+    off_t size;
+    int fd, err;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -errno;
+
+    /* Works for both image files and block devices */
+    if (fstat(fd, &st) == -1 || (size = lseek(fd, 0, SEEK_END)) == -1) {
+        err = -errno;
+        close(fd);
+        return err;
+    }
+    if ((!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode)) || size < ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        close(fd);
+        return -EINVAL;
+    }
+
+    /* The mapping keeps its own reference to the file */
+    base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    err = base == MAP_FAILED ? -errno : 0;
+    close(fd);
+    if (err)
+        return err;
+
+    img->base = base;
+    img->size = size;
+    img->blocks = size / ASSOOFS_DEFAULT_BLOCK_SIZE;
+    img->sb = base;
+
+    if (img->sb->magic != ASSOOFS_MAGIC || img->sb->version != ASSOOFS_VERSION || img->sb->block_size != ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        assoofs_close(img);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+void assoofs_close(struct assoofs_image *img) {
+    munmap((void *)img->base, img->size);
+    img->base = NULL;
+    img->sb = NULL;
+}
+
+const void *assoofs_block(const struct assoofs_image *img, uint64_t nr) {
+    if (nr >= img->blocks)
+        return NULL;
+    return img->base + nr * ASSOOFS_DEFAULT_BLOCK_SIZE;
+}
+
+const struct assoofs_inode_info *assoofs_inode(const struct assoofs_image *img, uint64_t ino) {
+    const struct assoofs_inode_info *table;
+
+    if (ino / ASSOOFS_INODES_PER_BLOCK >= img->sb->inode_table_blocks)
+        return NULL;
+    table = assoofs_block(img, ASSOOFS_INODE_BLOCK(img->sb, ino));
+    if (!table || table[ASSOOFS_INODE_OFFSET(ino)].inode_no != ino)
+        return NULL;
+    return &table[ASSOOFS_INODE_OFFSET(ino)];
+}
+
+const struct assoofs_extent *assoofs_extent(const struct assoofs_image *img, const struct assoofs_inode_info *inode, uint32_t i) {
+    const struct assoofs_extent_block *eb;
+
+    if (i >= inode->extents_count || inode->extents_count > ASSOOFS_MAX_EXTENTS)
+        return NULL;
+    if (i < ASSOOFS_INLINE_EXTENTS)
+        return &inode->extents[i];
+
+    eb = assoofs_block(img, inode->extent_block);
+    if (!eb)
+        return NULL;
+    return &eb->eb_extents[i - ASSOOFS_INLINE_EXTENTS];
+}
+
+int assoofs_map(const struct assoofs_image *img, const struct assoofs_inode_info *inode, uint64_t lblock, uint64_t *pblock, uint64_t *len) {
+    const struct assoofs_extent *ext;
+    uint32_t i;
+
+    /* Extents are sorted by logical block, like the module keeps them */
+    for (i = 0; i < inode->extents_count; i++) {
+        ext = assoofs_extent(img, inode, i);
+        if (!ext)
+            return -EIO;
+        if (lblock < ext->ee_block) {
+            *len = ext->ee_block - lblock;
+            return 0;
+        }
+        if (lblock < (uint64_t)ext->ee_block + ext->ee_len) {
+            *pblock = ext->ee_start + (lblock - ext->ee_block);
+            *len = ext->ee_block + ext->ee_len - lblock;
+            return 1;
+        }
+    }
+
+    *len = 0;
+    return 0;
+}
+
+int assoofs_file_span(const struct assoofs_image *img, const struct assoofs_inode_info *inode, uint64_t off, const void **data, uint64_t *len) {
+    uint64_t in_block = off % ASSOOFS_DEFAULT_BLOCK_SIZE, left, pblock, blocks;
+    int ret;
+
+    *data = NULL;
+    *len = 0;
+    if (off >= inode->file_size)
+        return 0;
+    left = inode->file_size - off;
+
+    if (inode->flags & ASSOOFS_INODE_INLINE_DATA) {
+        if (inode->file_size > ASSOOFS_INLINE_DATA_MAX)
+            return -EIO;
+        *data = inode->inline_data + off;
+        *len = left;
+        return 0;
+    }
+
+    ret = assoofs_map(img, inode, off / ASSOOFS_DEFAULT_BLOCK_SIZE, &pblock, &blocks);
+    if (ret < 0)
+        return ret;
+
+    if (ret) {
+        if (pblock > img->blocks || blocks > img->blocks - pblock)
+            return -EIO;
+        *data = img->base + pblock * ASSOOFS_DEFAULT_BLOCK_SIZE + in_block;
+    }
+    else if (!blocks) {
+        /* A hole up to the end of the file */
+        *len = left;
+        return 0;
+    }
+
+    *len = blocks * ASSOOFS_DEFAULT_BLOCK_SIZE - in_block;
+    if (*len > left)
+        *len = left;
+    return 0;
+}
+
+/* Logical block lblock of a directory, which must be mapped */
+static const unsigned char *dir_block(const struct assoofs_image *img, const struct assoofs_inode_info *dir, uint64_t lblock) {
+    uint64_t pblock, len;
+
+    if (assoofs_map(img, dir, lblock, &pblock, &len) != 1)
+        return NULL;
+    return assoofs_block(img, pblock);
+}
+
+int assoofs_dir_next(const struct assoofs_image *img, const struct assoofs_inode_info *dir, struct assoofs_dir_pos *pos, const struct assoofs_dir_record_entry **record) {
+    const struct assoofs_dx_root *root;
+    const unsigned char *block;
+
+    if (!S_ISDIR(dir->mode))
+        return -ENOTDIR;
+    root = (const struct assoofs_dx_root *)dir_block(img, dir, 0);
+    if (!root || root->magic != ASSOOFS_DX_MAGIC)
+        return -EIO;
+
+    /* Block 0 is the index root; index nodes look like leaves with a single free entry */
+    if (!pos->lblock)
+        pos->lblock = 1;
+
+    for (; pos->lblock < root->blocks; pos->lblock++, pos->offset = 0) {
+        block = dir_block(img, dir, pos->lblock);
+        if (!block)
+            return -EIO;
+
+        while (pos->offset < ASSOOFS_DEFAULT_BLOCK_SIZE) {
+            if (!assoofs_dir_rec_valid(block, pos->offset))
+                return -EIO;
+            *record = (const struct assoofs_dir_record_entry *)(block + pos->offset);
+            pos->offset += (*record)->rec_len;
+            if ((*record)->inode_no)
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+int assoofs_lookup(const struct assoofs_image *img, const struct assoofs_inode_info *dir, const char *name, unsigned int len, uint64_t *ino) {
+    const struct assoofs_dx_root *root;
+    const struct assoofs_dx_node *node;
+    const struct assoofs_dx_entry *at;
+    const struct assoofs_dir_record_entry *record;
+    const unsigned char *leaf;
+    uint32_t hash = assoofs_dx_hash(name, len);
+    unsigned int offset;
+
+    if (!S_ISDIR(dir->mode))
+        return -ENOTDIR;
+
+    /* The same walk down the index as the module's assoofs_dx_probe */
+    root = (const struct assoofs_dx_root *)dir_block(img, dir, 0);
+    if (!root || root->magic != ASSOOFS_DX_MAGIC || root->levels >= ASSOOFS_DX_MAX_LEVELS || !root->count || root->count > ASSOOFS_DX_ROOT_LIMIT)
+        return -EIO;
+    at = assoofs_dx_search((struct assoofs_dx_entry *)root->entries, root->count, hash);
+
+    if (root->levels) {
+        node = (const struct assoofs_dx_node *)(at->block < root->blocks ? dir_block(img, dir, at->block) : NULL);
+        if (!node || !node->count || node->count > ASSOOFS_DX_NODE_LIMIT)
+            return -EIO;
+        at = assoofs_dx_search((struct assoofs_dx_entry *)node->entries, node->count, hash);
+    }
+
+    leaf = at->block < root->blocks ? dir_block(img, dir, at->block) : NULL;
+    if (!leaf)
+        return -EIO;
+
+    for (offset = 0; offset < ASSOOFS_DEFAULT_BLOCK_SIZE; offset += record->rec_len) {
+        if (!assoofs_dir_rec_valid(leaf, offset))
+            return -EIO;
+        record = (const struct assoofs_dir_record_entry *)(leaf + offset);
+        if (record->inode_no && record->name_len == len && !memcmp(record->filename, name, len)) {
+            *ino = record->inode_no;
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
+int assoofs_namei(const struct assoofs_image *img, const char *path, uint64_t *ino) {
+    const struct assoofs_inode_info *dir;
+    size_t len;
+    int ret;
+
+    *ino = ASSOOFS_ROOTDIR_INODE_NUMBER;
+    for (;;) {
+        while (*path == '/')
+            path++;
+        if (!*path)
+            return 0;
+
+        len = strcspn(path, "/");
+        if (len > ASSOOFS_FILENAME_MAXLEN)
+            return -ENAMETOOLONG;
+        dir = assoofs_inode(img, *ino);
+        if (!dir)
+            return -EIO;
+        ret = assoofs_lookup(img, dir, path, len, ino);
+        if (ret)
+            return ret;
+        path += len;
+    }
+}
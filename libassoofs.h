@@ -0,0 +1,61 @@
+#ifndef LIBASSOOFS_H
+#define LIBASSOOFS_H
+
+#include "assoofs.h"
+
+/*
+ * Read-only access to an assoofs image without the kernel module. The image is mapped with mmap
+ * and every pointer handed out (superblock, inode records, directory entries, file data) points
+ * straight into the mapping: nothing is copied, and the pointers stay valid until assoofs_close.
+ *
+ * Functions returning int give 0 (or 1, where stated) on success and a negative errno otherwise;
+ * -EIO means the image is corrupt.
+ */
+struct assoofs_image {
+    const unsigned char *base;
+    uint64_t size;                          /* bytes mapped */
+    uint64_t blocks;                        /* whole blocks mapped */
+    const struct assoofs_super_block_info *sb;
+};
+
+/* Position of a directory walk; start it zeroed */
+struct assoofs_dir_pos {
+    uint32_t lblock;
+    uint32_t offset;
+};
+
+int assoofs_open(struct assoofs_image *img, const char *path);
+void assoofs_close(struct assoofs_image *img);
+
+/* Block nr of the image, or NULL past the end of the mapping */
+const void *assoofs_block(const struct assoofs_image *img, uint64_t nr);
+
+/* The record of inode ino, or NULL if ino is outside the table or its slot is free */
+const struct assoofs_inode_info *assoofs_inode(const struct assoofs_image *img, uint64_t ino);
+
+/* Extent i (< extents_count) of an inode, from the record or from its extent block */
+const struct assoofs_extent *assoofs_extent(const struct assoofs_image *img, const struct assoofs_inode_info *inode, uint32_t i);
+
+/*
+ * Physical block of logical block lblock. Returns 1 if it is mapped, with *len the blocks left in
+ * the extent, or 0 for a hole, with *len the blocks up to the next extent (0 if there is none).
+ */
+int assoofs_map(const struct assoofs_image *img, const struct assoofs_inode_info *inode, uint64_t lblock, uint64_t *pblock, uint64_t *len);
+
+/*
+ * The bytes of a file from offset off: *data points at them and *len says how many are contiguous
+ * in the image (at most up to the end of the file). In a hole *data is NULL and the *len bytes
+ * read as zeros. *len is 0 at the end of the file.
+ */
+int assoofs_file_span(const struct assoofs_image *img, const struct assoofs_inode_info *inode, uint64_t off, const void **data, uint64_t *len);
+
+/* Next entry in use of a directory, in disk order. Returns 1 with *record set, 0 at the end */
+int assoofs_dir_next(const struct assoofs_image *img, const struct assoofs_inode_info *dir, struct assoofs_dir_pos *pos, const struct assoofs_dir_record_entry **record);
+
+/* Inode number of name in dir, through the directory index */
+int assoofs_lookup(const struct assoofs_image *img, const struct assoofs_inode_info *dir, const char *name, unsigned int len, uint64_t *ino);
+
+/* Inode number of an absolute path ("/" is the root) */
+int assoofs_namei(const struct assoofs_image *img, const char *path, uint64_t *ino);
+
+#endif /* LIBASSOOFS_H */
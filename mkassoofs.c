@@ -2,159 +2,958 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <arpa/inet.h>
 #include "assoofs.h"
 
-#define WELCOMEFILE_DATABLOCK_NUMBER (ASSOOFS_LAST_RESERVED_BLOCK + 1)
-#define WELCOMEFILE_INODE_NUMBER (ASSOOFS_LAST_RESERVED_INODE + 1)
+/* By default the journal is only created when it takes at most 1/16 of the device */
+#define DEFAULT_JOURNAL_BLOCKS ASSOOFS_MIN_JOURNAL_BLOCKS
 
-static int write_superblock(int fd) {
-    struct assoofs_super_block_info sb = {
-        .version = 1,
-        .magic = ASSOOFS_MAGIC,
-        .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE,
-        .inodes_count = WELCOMEFILE_INODE_NUMBER,
-        .free_blocks = (~0) & ~(7),
-    };
+/* Without -N, one inode per this many bytes (like mke2fs), and never less than the first table block holds */
+#define BYTES_PER_INODE 16384
+#define MIN_INODES ((long long)(ASSOOFS_INODES_PER_BLOCK - ASSOOFS_START_INO))
+
+/* Start of the jbd2 journal superblock, the part an empty journal needs. All fields are big endian */
+#define JBD2_MAGIC_NUMBER 0xc03b3998U
+#define JBD2_SUPERBLOCK_V2 4
+
+struct jbd2_superblock {
+    uint32_t h_magic;
+    uint32_t h_blocktype;
+    uint32_t h_sequence;
+    uint32_t s_blocksize;
+    uint32_t s_maxlen;
+    uint32_t s_first;
+    uint32_t s_sequence;
+    uint32_t s_start;
+    uint32_t s_errno;
+    uint32_t s_feature_compat;
+    uint32_t s_feature_incompat;
+    uint32_t s_feature_ro_compat;
+    uint8_t s_uuid[16];
+    uint32_t s_nr_users;
+};
+
+static uint64_t blocks_count;
+static uint64_t inode_table_blocks = 1;
+static uint64_t bitmap_block_number;
+static uint64_t bitmap_blocks;
+static uint64_t journal_block_number;
+static uint64_t journal_blocks;
+static uint64_t rootdir_datablock_number;
+static uint64_t reserved_blocks;
+static uint64_t first_free_block;      /* everything below is metadata, directories or file data */
+static uint64_t next_inode_no = ASSOOFS_START_INO;
+
+/* Metadata blocks with contents of their own; the bitmap needs at most two (see write_bitmap) */
+enum { META_SB, META_BITMAP, META_JOURNAL = META_BITMAP + 2, META_BLOCKS };
+#define META(meta, n) ((meta) + (n) * ASSOOFS_DEFAULT_BLOCK_SIZE)
+
+/* Every block of the image is built in memory and handed to the kernel in pwritev batches */
+static unsigned char zero_block[ASSOOFS_DEFAULT_BLOCK_SIZE];
+static unsigned char full_block[ASSOOFS_DEFAULT_BLOCK_SIZE];
+
+/* Linux takes at most 1024 iovecs (UIO_MAXIOV) per call: 4 MiB of metadata */
+#define BATCH_BLOCKS 1024
+
+struct batch {
+    int fd;
+    uint64_t block;             /* where the first queued buffer goes */
+    int count;
+    struct iovec iov[BATCH_BLOCKS];
+};
+
+static int batch_flush(struct batch *b) {
+    off_t off = (off_t)b->block * ASSOOFS_DEFAULT_BLOCK_SIZE;
+    int i = 0;
     ssize_t ret;
 
-    ret = write(fd, &sb, sizeof(sb));
-    if (ret != ASSOOFS_DEFAULT_BLOCK_SIZE) {
-        printf("Bytes written [%d] are not equal to the default block size.\n", (int)ret);
-        return -1;
+    /* pwritev may stop short; carry on from the first buffer it did not finish */
+    while (i < b->count) {
+        ret = pwritev(b->fd, b->iov + i, b->count - i, off);
+        if (ret <= 0) {
+            perror("Error writing the device");
+            return -1;
+        }
+        off += ret;
+        while (i < b->count && (size_t)ret >= b->iov[i].iov_len) {
+            ret -= b->iov[i].iov_len;
+            i++;
+        }
+        if (i < b->count) {
+            b->iov[i].iov_base = (char *)b->iov[i].iov_base + ret;
+            b->iov[i].iov_len -= ret;
+        }
     }
 
-    printf("Super block written succesfully.\n");
+    b->block += b->count;
+    b->count = 0;
     return 0;
 }
 
-static int write_root_inode(int fd) {
-    ssize_t ret;
+/* Queue one block for block number nr; a gap since the last one starts a new pwritev */
+static int batch_add(struct batch *b, uint64_t nr, const void *buf) {
+    if (b->count && (nr != b->block + b->count || b->count == BATCH_BLOCKS))
+        if (batch_flush(b))
+            return -1;
+    if (!b->count)
+        b->block = nr;
 
-    struct assoofs_inode_info root_inode;
+    b->iov[b->count].iov_base = (void *)buf;
+    b->iov[b->count].iov_len = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    b->count++;
+    return 0;
+}
 
-    root_inode.mode = S_IFDIR;
-    root_inode.inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
-    root_inode.data_block_number = ASSOOFS_ROOTDIR_DATABLOCK_NUMBER;
-    root_inode.dir_children_count = 1;
+/*
+ * Generated blocks (directories) are built in a staging area that stays queued until the batch
+ * goes out; it is recycled once the whole area has been handed to the kernel.
+ */
+static unsigned char *stage;
+static int stage_next;
 
-    ret = write(fd, &root_inode, sizeof(root_inode));
+static unsigned char *stage_block(struct batch *b) {
+    if (stage_next == BATCH_BLOCKS) {
+        if (batch_flush(b))
+            return NULL;
+        stage_next = 0;
+    }
+    return memset(stage + (size_t)stage_next++ * ASSOOFS_DEFAULT_BLOCK_SIZE, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+}
 
-    if (ret != sizeof(root_inode)) {
-        printf("The inode store was not written properly.\n");
+/* A file or directory of the new filesystem */
+struct node {
+    char *path;                 /* in the source tree; NULL for the welcome file */
+    const char *name;
+    const char *data;           /* contents of a file that does not come from the source tree */
+    mode_t mode;
+    uint64_t size;
+    uint64_t inode_no;
+    uint32_t hash;
+    uint64_t start;             /* first data block */
+    uint64_t blocks;
+    struct node **children;     /* sorted by name hash, the order of the directory index */
+    uint64_t nchildren;
+    uint64_t *leaf_first;       /* first child of each index leaf, plus one past the last */
+    uint64_t leaves;
+};
+
+/* Directories in the order their blocks are laid out (the root first), then files with data blocks */
+static struct node **dirs, **files;
+static uint64_t ndirs, nfiles;
+
+static int append(struct node ***array, uint64_t *count, struct node *node) {
+    struct node **grown;
+
+    /* Grows whenever count reaches a power of two (or is 0) */
+    if (!(*count & (*count - 1))) {
+        grown = realloc(*array, (*count ? *count * 2 : 1) * sizeof(**array));
+        if (!grown)
+            return -1;
+        *array = grown;
+    }
+    (*array)[(*count)++] = node;
+    return 0;
+}
+
+static int node_cmp(const void *a, const void *b) {
+    const struct node *x = *(const struct node * const *)a, *y = *(const struct node * const *)b;
+
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+static struct node *new_node(const char *name, mode_t mode, uint64_t size) {
+    struct node *node = calloc(1, sizeof(*node));
+
+    if (!node)
+        return NULL;
+    node->name = name;
+    node->mode = mode;
+    node->size = size;
+    node->hash = assoofs_dx_hash(name, strlen(name));
+    node->inode_no = next_inode_no++;
+    return node;
+}
+
+static int add_child(struct node *dir, struct node *child) {
+    if (append(&dir->children, &dir->nchildren, child))
+        return -1;
+    if (S_ISREG(child->mode) && child->size > ASSOOFS_INLINE_DATA_MAX) {
+        child->blocks = (child->size + ASSOOFS_DEFAULT_BLOCK_SIZE - 1) / ASSOOFS_DEFAULT_BLOCK_SIZE;
+        return append(&files, &nfiles, child);
+    }
+    return 0;
+}
+
+/* Reads one directory of the source tree, then the directories below it */
+static int scan_dir(struct node *dir) {
+    DIR *d;
+    struct dirent *de;
+    struct stat st;
+    struct node *child;
+    char *path;
+    size_t len;
+    uint64_t i;
+
+    d = opendir(dir->path);
+    if (!d) {
+        perror(dir->path);
         return -1;
     }
 
-    printf("root directory inode written succesfully.\n");
+    while ((de = readdir(d))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        len = strlen(dir->path) + strlen(de->d_name) + 2;
+        path = malloc(len);
+        if (!path)
+            goto nomem;
+        snprintf(path, len, "%s/%s", dir->path, de->d_name);
+
+        if (lstat(path, &st) == -1) {
+            perror(path);
+            goto fail;
+        }
+        /* The filesystem has nothing else to keep; hard links become separate copies */
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "Skipping %s: only regular files and directories are copied.\n", path);
+            free(path);
+            continue;
+        }
+        if (strlen(de->d_name) > ASSOOFS_FILENAME_MAXLEN) {
+            fprintf(stderr, "%s: name too long.\n", path);
+            goto fail;
+        }
+        if ((uint64_t)st.st_size / ASSOOFS_DEFAULT_BLOCK_SIZE >= UINT32_MAX) {
+            fprintf(stderr, "%s: file too large.\n", path);
+            goto fail;
+        }
+
+        child = new_node(path + len - 1 - strlen(de->d_name), st.st_mode & (S_IFMT | 07777), S_ISREG(st.st_mode) ? st.st_size : 0);
+        if (!child)
+            goto nomem;
+        child->path = path;
+        if (add_child(dir, child))
+            goto nomem;
+    }
+    closedir(d);
+
+    if (dir->nchildren)
+        qsort(dir->children, dir->nchildren, sizeof(*dir->children), node_cmp);
+
+    /* Only one directory stream is open at a time, however deep the tree */
+    for (i = 0; i < dir->nchildren; i++) {
+        child = dir->children[i];
+        if (S_ISDIR(child->mode) && (append(&dirs, &ndirs, child) || scan_dir(child)))
+            return -1;
+    }
     return 0;
+
+nomem:
+    fprintf(stderr, "Out of memory.\n");
+    goto close;
+fail:
+    free(path);
+close:
+    closedir(d);
+    return -1;
 }
 
-static int write_welcome_inode(int fd, const struct assoofs_inode_info *i) {
-    off_t nbytes;
-    ssize_t ret;
+/*
+ * Splits the entries of a directory into index leaves, each as full as it gets. A leaf never
+ * starts in the middle of a run of names with the same hash: lookups only search one leaf.
+ */
+static int pack_leaves(struct node *dir) {
+    uint64_t i, run, used = 0;
+    unsigned int len;
 
-    ret = write(fd, i, sizeof(*i));
-    if (ret != sizeof(*i)) {
-        printf("The welcomefile inode was not written properly.\n");
+    dir->leaf_first = malloc((dir->nchildren + 2) * sizeof(*dir->leaf_first));
+    if (!dir->leaf_first)
         return -1;
+    dir->leaf_first[0] = 0;
+    dir->leaves = 1;
+
+    for (i = 0; i < dir->nchildren; ) {
+        len = ASSOOFS_DIR_REC_LEN(strlen(dir->children[i]->name));
+        if (used + len <= ASSOOFS_DEFAULT_BLOCK_SIZE) {
+            used += len;
+            i++;
+            continue;
+        }
+
+        for (run = i; run > dir->leaf_first[dir->leaves - 1] && dir->children[run]->hash == dir->children[run - 1]->hash; run--)
+            ;
+        if (run == dir->leaf_first[dir->leaves - 1]) {
+            fprintf(stderr, "%s: too many names with the same hash.\n", dir->path);
+            return -1;
+        }
+        dir->leaf_first[dir->leaves++] = i = run;
+        used = 0;
     }
-    printf("welcomefile inode written succesfully.\n");
+    dir->leaf_first[dir->leaves] = dir->nchildren;
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - (sizeof(*i) * 2);
-    ret = lseek(fd, nbytes, SEEK_CUR);
-    if (ret == (off_t)-1) {
-        printf("The padding bytes are not written properly.\n");
+    /* The index root, the leaves and, when the root cannot point at every leaf, one level of nodes */
+    dir->blocks = 1 + dir->leaves;
+    if (dir->leaves > ASSOOFS_DX_ROOT_LIMIT)
+        dir->blocks += (dir->leaves + ASSOOFS_DX_NODE_LIMIT - 1) / ASSOOFS_DX_NODE_LIMIT;
+    if (dir->blocks - 1 - dir->leaves > ASSOOFS_DX_ROOT_LIMIT) {
+        fprintf(stderr, "%s: too many entries.\n", dir->path);
         return -1;
     }
+    return 0;
+}
+
+/* Directories first, right after the metadata, then file data; each one takes a single extent */
+static int layout(void) {
+    uint64_t i, next = rootdir_datablock_number;
+
+    for (i = 0; i < ndirs; i++) {
+        if (pack_leaves(dirs[i]))
+            return -1;
+        dirs[i]->start = next;
+        next += dirs[i]->blocks;
+    }
+    for (i = 0; i < nfiles; i++) {
+        files[i]->start = next;
+        next += files[i]->blocks;
+    }
+
+    first_free_block = next;
+    return 0;
+}
+
+static int write_superblock(struct batch *b, struct assoofs_super_block_info *sb) {
+    *sb = (struct assoofs_super_block_info) {
+        .version = ASSOOFS_VERSION,
+        .magic = ASSOOFS_MAGIC,
+        .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE,
+        /* The module hands out inode number inodes_count + START - RESERVED + 1 next */
+        .inodes_count = next_inode_no - (ASSOOFS_START_INO - ASSOOFS_RESERVED_INODES + 1),
+        .blocks_count = blocks_count,
+        .inode_table_block = ASSOOFS_INODESTORE_BLOCK_NUMBER,
+        .inode_table_blocks = inode_table_blocks,
+        .bitmap_block = bitmap_block_number,
+        .bitmap_blocks = bitmap_blocks,
+        .journal_block = journal_block_number,
+        .journal_blocks = journal_blocks,
+        .free_blocks = blocks_count - first_free_block,
+        .state = ASSOOFS_STATE_CLEAN,
+        .reserved_blocks = reserved_blocks,
+    };
+
+    return batch_add(b, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER, sb);
+}
+
+/* pread that fills the buffer with zeros past the end of the file */
+static int read_file(const struct node *node, int fd, unsigned char *buf, uint64_t len, uint64_t off) {
+    uint64_t want = off < node->size ? node->size - off : 0, done = 0;
+    ssize_t ret;
+
+    if (want > len)
+        want = len;
+    while (done < want) {
+        ret = pread(fd, buf + done, want - done, off + done);
+        if (ret < 0) {
+            perror(node->path);
+            return -1;
+        }
+        if (!ret) {
+            fprintf(stderr, "%s: file shrank while copying; the rest is left as zeros.\n", node->path);
+            break;
+        }
+        done += ret;
+    }
+    memset(buf + done, 0, len - done);
+    return 0;
+}
+
+static void fill_inode(struct assoofs_inode_info *info, const struct node *node) {
+    info->mode = node->mode;
+    info->inode_no = node->inode_no;
+    if (S_ISDIR(node->mode))
+        info->dir_children_count = node->nchildren;
+    else
+        info->file_size = node->size;
+
+    if (node->blocks) {
+        info->extents_count = 1;
+        info->extents[0].ee_block = 0;
+        info->extents[0].ee_len = node->blocks;
+        info->extents[0].ee_start = node->start;
+    }
+    else
+        info->flags = ASSOOFS_INODE_INLINE_DATA;
+}
+
+static int write_inode_table(struct batch *b, struct assoofs_inode_info *table, int zero_itable) {
+    uint64_t used = (next_inode_no - 1) / ASSOOFS_INODES_PER_BLOCK + 1;
+    struct node *node;
+    uint64_t i, j;
+    int fd;
+
+    /* Each inode lives at the slot given by its inode number */
+    for (i = 0; i < ndirs; i++) {
+        fill_inode(&table[dirs[i]->inode_no], dirs[i]);
+
+        /* Small files are read here, straight into their records */
+        for (j = 0; j < dirs[i]->nchildren; j++) {
+            node = dirs[i]->children[j];
+            if (S_ISDIR(node->mode))
+                continue;
+            fill_inode(&table[node->inode_no], node);
+            if (node->blocks || !node->size)
+                continue;
+            if (node->data) {
+                memcpy(table[node->inode_no].inline_data, node->data, node->size);
+                continue;
+            }
+            fd = open(node->path, O_RDONLY);
+            if (fd == -1) {
+                perror(node->path);
+                return -1;
+            }
+            if (read_file(node, fd, (unsigned char *)table[node->inode_no].inline_data, node->size, 0)) {
+                close(fd);
+                return -1;
+            }
+            close(fd);
+        }
+    }
+
+    for (i = 0; i < used; i++)
+        if (batch_add(b, ASSOOFS_INODESTORE_BLOCK_NUMBER + i, (char *)table + i * ASSOOFS_DEFAULT_BLOCK_SIZE))
+            return -1;
+
+    /*
+     * The rest of the table may be left as it is: inode numbers are handed out in order and a
+     * record is always written whole by the create that takes its slot, before anything can
+     * look it up. Zeroing is only needed to wipe an old filesystem's records for good.
+     */
+    if (zero_itable)
+        for (; i < inode_table_blocks; i++)
+            if (batch_add(b, ASSOOFS_INODESTORE_BLOCK_NUMBER + i, zero_block))
+                return -1;
 
-    printf("inode store padding bytes (after two inodes) written sucessfully.\n");
     return 0;
 }
 
-int write_dirent(int fd, const struct assoofs_dir_record_entry *record) {
-    ssize_t nbytes = sizeof(*record), ret;
+/* Set bits [from, to) of one bitmap block */
+static void set_bits(unsigned char *map, uint64_t from, uint64_t to) {
+    for (; from < to && from % 8; from++)
+        map[from / 8] |= 1 << (from % 8);
+    if (from + 8 <= to) {
+        memset(map + from / 8, 0xff, (to - from) / 8);
+        from += (to - from) & ~7ULL;
+    }
+    for (; from < to; from++)
+        map[from / 8] |= 1 << (from % 8);
+}
+
+static int write_bitmap(struct batch *b, unsigned char *partial) {
+    uint64_t group, first, last, used_from, used_to;
+    uint64_t used = first_free_block;
+    const unsigned char *map;
 
-    ret = write(fd, record, nbytes);
-    if (ret != nbytes) {
-        printf("Writing the rootdirectory datablock (name+inode_no pair for welcomefile) has failed.\n");
+    /*
+     * Blocks up to the last file are in use, and so are the bits past the end of the
+     * device. Whole groups of either kind share full_block, free groups share zero_block and
+     * only the (at most two) groups that straddle a boundary get a buffer of their own.
+     */
+    for (group = 0; group < bitmap_blocks; group++) {
+        first = group * ASSOOFS_BLOCKS_PER_GROUP;
+        last = first + ASSOOFS_BLOCKS_PER_GROUP;
+
+        if (last <= used)
+            map = full_block;
+        else if (first >= used && last <= blocks_count)
+            map = zero_block;
+        else {
+            map = partial;
+            memset(partial, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+            used_to = used > first ? used - first : 0;
+            set_bits(partial, 0, used_to);
+            used_from = blocks_count > first ? blocks_count - first : 0;
+            if (used_from < ASSOOFS_BLOCKS_PER_GROUP)
+                set_bits(partial, used_from, ASSOOFS_BLOCKS_PER_GROUP);
+            partial += ASSOOFS_DEFAULT_BLOCK_SIZE;
+        }
+
+        if (batch_add(b, bitmap_block_number + group, map))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int write_journal(struct batch *b, unsigned char *block) {
+    struct jbd2_superblock *jsb = (struct jbd2_superblock *)block;
+    uint64_t i;
+
+    if (!journal_blocks)
+        return 0;
+
+    memset(block, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    jsb->h_magic = htonl(JBD2_MAGIC_NUMBER);
+    jsb->h_blocktype = htonl(JBD2_SUPERBLOCK_V2);
+    jsb->s_blocksize = htonl(ASSOOFS_DEFAULT_BLOCK_SIZE);
+    jsb->s_maxlen = htonl(journal_blocks);
+    jsb->s_first = htonl(1);
+    jsb->s_sequence = htonl(1);
+    jsb->s_nr_users = htonl(1);
+
+    if (batch_add(b, journal_block_number, block))
         return -1;
+
+    /*
+     * The log area is zeroed, as mke2fs does: on a reused device an old descriptor or commit
+     * block whose sequence number happens to follow on could otherwise be replayed at the
+     * first mount that finds the journal in use.
+     */
+    for (i = 1; i < journal_blocks; i++)
+        if (batch_add(b, journal_block_number + i, zero_block))
+            return -1;
+
+    return 0;
+}
+
+/* Fills an index level (root or node) with the leaves or nodes it points at */
+static void fill_dx_entries(struct assoofs_dx_entry *entries, uint32_t *count, const struct node *dir, uint64_t from, uint64_t to, uint64_t leaves_per_entry, uint32_t first_block) {
+    uint64_t i;
+
+    /* An empty directory has a single empty leaf */
+    for (*count = 0, i = from; i < to; i += leaves_per_entry, (*count)++) {
+        entries[*count].hash = dir->nchildren ? dir->children[dir->leaf_first[i]]->hash : 0;
+        entries[*count].block = first_block + *count;
     }
-    printf("root directory datablocks (name+inode_no pair for welcomefile) written succesfully.\n");
+}
+
+static int write_dir(struct batch *b, const struct node *dir) {
+    struct assoofs_dx_root *root;
+    struct assoofs_dx_node *node;
+    struct assoofs_dir_record_entry *record = NULL;
+    unsigned char *block;
+    uint64_t leaf, i, nodes = dir->blocks - 1 - dir->leaves;
+    unsigned int offset;
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(*record);
-    ret = lseek(fd, nbytes, SEEK_CUR);
-    if (ret == (off_t)-1) {
-        printf("Writing the padding for rootdirectory children datablock has failed.\n");
+    /* Logical block 0 is the index root; leaves follow from block 1, nodes after the leaves */
+    root = (struct assoofs_dx_root *)stage_block(b);
+    if (!root)
+        return -1;
+    root->magic = ASSOOFS_DX_MAGIC;
+    root->blocks = dir->blocks;
+    root->levels = nodes ? 1 : 0;
+    if (nodes)
+        fill_dx_entries(root->entries, &root->count, dir, 0, dir->leaves, ASSOOFS_DX_NODE_LIMIT, 1 + dir->leaves);
+    else
+        fill_dx_entries(root->entries, &root->count, dir, 0, dir->leaves, 1, 1);
+    /* The first entry covers every hash below the second one */
+    root->entries[0].hash = 0;
+    if (batch_add(b, dir->start, root))
         return -1;
+
+    for (leaf = 0; leaf < dir->leaves; leaf++) {
+        block = stage_block(b);
+        if (!block)
+            return -1;
+
+        /* An empty leaf is a single free entry; otherwise the last entry runs to the end */
+        offset = 0;
+        record = (struct assoofs_dir_record_entry *)block;
+        for (i = dir->leaf_first[leaf]; i < dir->leaf_first[leaf + 1]; i++) {
+            record = (struct assoofs_dir_record_entry *)(block + offset);
+            record->inode_no = dir->children[i]->inode_no;
+            record->name_len = strlen(dir->children[i]->name);
+            record->rec_len = ASSOOFS_DIR_REC_LEN(record->name_len);
+            record->file_type = S_ISDIR(dir->children[i]->mode) ? ASSOOFS_FT_DIR : ASSOOFS_FT_REG_FILE;
+            memcpy(record->filename, dir->children[i]->name, record->name_len);
+            offset += record->rec_len;
+        }
+        record->rec_len = ASSOOFS_DEFAULT_BLOCK_SIZE - ((unsigned char *)record - block);
+
+        if (batch_add(b, dir->start + 1 + leaf, block))
+            return -1;
     }
-    printf("Padding after the rootdirectory children written succesfully.\n");
+
+    for (i = 0; i < nodes; i++) {
+        node = (struct assoofs_dx_node *)stage_block(b);
+        if (!node)
+            return -1;
+        node->fake_rec_len = ASSOOFS_DEFAULT_BLOCK_SIZE;
+        leaf = i * ASSOOFS_DX_NODE_LIMIT;
+        fill_dx_entries(node->entries, &node->count, dir, leaf,
+                        leaf + ASSOOFS_DX_NODE_LIMIT < dir->leaves ? leaf + ASSOOFS_DX_NODE_LIMIT : dir->leaves, 1, 1 + leaf);
+        if (batch_add(b, dir->start + 1 + dir->leaves + i, node))
+            return -1;
+    }
+
     return 0;
 }
 
-int write_block(int fd, char *block, size_t len) {
+/*
+ * File data is copied by a few threads. Each one claims a run of consecutive files (they are
+ * contiguous on disk too), reads them into its buffer and writes the run with one pwrite.
+ */
+#define COPY_THREADS 8
+#define COPY_BLOCKS 1024
+
+struct copy {
+    pthread_mutex_t lock;
+    int fd;
+    uint64_t next;              /* first file nobody has claimed */
+    int error;
+};
+
+static int write_full(int fd, const unsigned char *buf, uint64_t len, uint64_t block) {
+    off_t off = (off_t)block * ASSOOFS_DEFAULT_BLOCK_SIZE;
     ssize_t ret;
 
-    ret = write(fd, block, len);
-    if (ret != len) {
-        printf("Writing file body has failed.\n");
-        return -1;
+    while (len) {
+        ret = pwrite(fd, buf, len, off);
+        if (ret <= 0) {
+            perror("Error writing the device");
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+        off += ret;
+    }
+    return 0;
+}
+
+static int copy_files(int fd, struct node **run, uint64_t count, unsigned char *buf) {
+    uint64_t block = run[0]->start, used = 0, off, len, i;
+    int src, ret = 0;
+
+    for (i = 0; i < count && !ret; i++) {
+        src = open(run[i]->path, O_RDONLY);
+        if (src == -1) {
+            perror(run[i]->path);
+            return -1;
+        }
+
+        /* A file larger than the buffer goes out in buffer-sized pieces */
+        for (off = 0; off < run[i]->blocks * ASSOOFS_DEFAULT_BLOCK_SIZE && !ret; off += len) {
+            len = run[i]->blocks * ASSOOFS_DEFAULT_BLOCK_SIZE - off;
+            if (len > COPY_BLOCKS * ASSOOFS_DEFAULT_BLOCK_SIZE - used)
+                len = COPY_BLOCKS * ASSOOFS_DEFAULT_BLOCK_SIZE - used;
+            ret = read_file(run[i], src, buf + used, len, off);
+            used += len;
+            if (!ret && used == COPY_BLOCKS * ASSOOFS_DEFAULT_BLOCK_SIZE) {
+                ret = write_full(fd, buf, used, block);
+                block += COPY_BLOCKS;
+                used = 0;
+            }
+        }
+        close(src);
+    }
+
+    if (!ret && used)
+        ret = write_full(fd, buf, used, block);
+    return ret;
+}
+
+static void *copy_thread(void *arg) {
+    struct copy *c = arg;
+    unsigned char *buf = aligned_alloc(ASSOOFS_DEFAULT_BLOCK_SIZE, COPY_BLOCKS * ASSOOFS_DEFAULT_BLOCK_SIZE);
+    uint64_t first, last, blocks;
+    int ret = buf ? 0 : -1;
+
+    while (!ret) {
+        pthread_mutex_lock(&c->lock);
+        first = last = c->next;
+        for (blocks = 0; last < nfiles && !c->error; last++) {
+            if (blocks && blocks + files[last]->blocks > COPY_BLOCKS)
+                break;
+            blocks += files[last]->blocks;
+        }
+        c->next = last;
+        pthread_mutex_unlock(&c->lock);
+
+        if (first == last)
+            break;
+        ret = copy_files(c->fd, files + first, last - first, buf);
+    }
+
+    if (ret) {
+        pthread_mutex_lock(&c->lock);
+        c->error = 1;
+        pthread_mutex_unlock(&c->lock);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Sizes take an optional K, M, G or T suffix (powers of 1024) */
+static int parse_size(const char *arg, uint64_t *size) {
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 0);
+    int shift = 0;
+
+    switch (*end) {
+    case 'T': case 't': shift += 10; /* fall through */
+    case 'G': case 'g': shift += 10; /* fall through */
+    case 'M': case 'm': shift += 10; /* fall through */
+    case 'K': case 'k': shift += 10; end++; break;
     }
-    printf("block has been written succesfully.\n");
+    if (end == arg || *end || (shift && value > (UINT64_MAX >> shift)))
+        return -1;
+
+    *size = (uint64_t)value << shift;
     return 0;
 }
 
+static void usage(void) {
+    printf("Usage: mkassoofs [-s size] [-b block_size] [-N inodes] [-m reserved%%] [-J journal_blocks] [-d dir] [-z] <device>\n");
+    printf("  -s  filesystem size (K, M, G, T suffixes); an image file is created or grown to it.\n");
+    printf("      Defaults to the whole device.\n");
+    printf("  -b  block size; only %d is supported.\n", ASSOOFS_DEFAULT_BLOCK_SIZE);
+    printf("  -N  inodes on top of those -d copies (default one per %d KiB of the filesystem, at least %d,\n", BYTES_PER_INODE / 1024, (int)MIN_INODES);
+    printf("      or as many as -d copies if that is more).\n");
+    printf("  -m  percentage of blocks kept for processes with CAP_SYS_RESOURCE (default 0).\n");
+    printf("  -J  0 formats without a journal; otherwise at least %d blocks.\n", ASSOOFS_MIN_JOURNAL_BLOCKS);
+    printf("  -d  copy the files and directories under dir into the new filesystem.\n");
+    printf("  -z  zero the whole inode table instead of only its first block.\n");
+}
+
 int main(int argc, char *argv[])
 {
-    int fd;
-    ssize_t ret;
-    char welcomefile_body[] = "Hola mundo, os saludo desde un sistema de ficheros ASSOOFS.\n";
-    
-    struct assoofs_inode_info welcome = {
-        .mode = S_IFREG,
-        .inode_no = WELCOMEFILE_INODE_NUMBER,
-        .data_block_number = WELCOMEFILE_DATABLOCK_NUMBER,
-        .file_size = sizeof(welcomefile_body),
-    };
-    
-    struct assoofs_dir_record_entry record = {
-        .filename = "README.txt",
-        .inode_no = WELCOMEFILE_INODE_NUMBER,
-    };
+    int fd, opt, ret;
+    int zero_itable = 0;
+    struct stat st;
+    struct batch *batch;
+    struct copy copy = { .lock = PTHREAD_MUTEX_INITIALIZER };
+    pthread_t threads[COPY_THREADS];
+    struct node *root, *welcome;
+    unsigned char *meta;
+    struct assoofs_inode_info *table;
+    uint64_t size = 0, device_size, populated;
+    long long inodes = -1;
+    unsigned long reserved_percent = 0;
+    long long journal = -1;
+    long nthreads = 0, i;
+    const char *source = NULL;
+    static const char welcomefile_body[] = "Hola mundo, os saludo desde un sistema de ficheros ASSOOFS.\n";
+
+    while ((opt = getopt(argc, argv, "s:b:N:m:J:d:z")) != -1) {
+        switch (opt) {
+        case 's':
+            if (parse_size(optarg, &size) || size < ASSOOFS_DEFAULT_BLOCK_SIZE) {
+                usage();
+                return -1;
+            }
+            break;
+        case 'b':
+            /* The module works with fixed-size blocks; the option is there for scripts that pass it */
+            if (strtoul(optarg, NULL, 0) != ASSOOFS_DEFAULT_BLOCK_SIZE) {
+                printf("Only %d-byte blocks are supported.\n", ASSOOFS_DEFAULT_BLOCK_SIZE);
+                return -1;
+            }
+            break;
+        case 'N':
+            inodes = strtoll(optarg, NULL, 0);
+            if (inodes < 0) {
+                usage();
+                return -1;
+            }
+            break;
+        case 'm':
+            reserved_percent = strtoul(optarg, NULL, 0);
+            if (reserved_percent > 50) {
+                usage();
+                return -1;
+            }
+            break;
+        case 'J':
+            journal = strtoll(optarg, NULL, 0);
+            if (journal != 0 && journal < ASSOOFS_MIN_JOURNAL_BLOCKS) {
+                usage();
+                return -1;
+            }
+            break;
+        case 'd':
+            source = optarg;
+            break;
+        case 'z':
+            zero_itable = 1;
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
 
-    if (argc != 2) {
-        printf("Usage: mkassoofs <device>\n");
+    if (optind != argc - 1) {
+        usage();
         return -1;
     }
 
-    fd = open(argv[1], O_RDWR);
-    if (fd == -1) {
+    /* The tree is read first: its size decides the inode table and whether the device is big enough */
+    root = new_node("/", S_IFDIR, 0);
+    if (!root || append(&dirs, &ndirs, root)) {
+        printf("Out of memory.\n");
+        return -1;
+    }
+    /* The root has a number of its own; the rest are handed out from ASSOOFS_START_INO */
+    root->inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
+    next_inode_no = ASSOOFS_START_INO;
+
+    if (source) {
+        if (stat(source, &st) == -1 || !S_ISDIR(st.st_mode)) {
+            printf("%s is not a directory.\n", source);
+            return -1;
+        }
+        root->path = (char *)source;
+        root->mode = st.st_mode & (S_IFMT | 07777);
+        if (scan_dir(root))
+            return -1;
+    }
+    else {
+        /* The welcome file is small enough to live inside its inode record */
+        welcome = new_node("README.txt", S_IFREG, sizeof(welcomefile_body));
+        if (!welcome || add_child(root, welcome)) {
+            printf("Out of memory.\n");
+            return -1;
+        }
+        welcome->data = welcomefile_body;
+    }
+    populated = next_inode_no - ASSOOFS_START_INO;
+
+    /* With -s an image file may not exist yet */
+    fd = open(argv[optind], O_RDWR | (size ? O_CREAT : 0), 0644);
+    if (fd == -1 || fstat(fd, &st) == -1) {
         perror("Error opening the device");
         return -1;
     }
 
-    ret = 1;
+    /* Works for both block devices and image files */
+    device_size = lseek(fd, 0, SEEK_END);
+    if (!size)
+        size = device_size;
+    if (size > device_size) {
+        /* A regular file grows sparsely: only the blocks written below take space */
+        if (!S_ISREG(st.st_mode) || ftruncate(fd, size) == -1) {
+            printf("The device has only %llu bytes.\n", (unsigned long long)device_size);
+            close(fd);
+            return -1;
+        }
+    }
+    blocks_count = size / ASSOOFS_DEFAULT_BLOCK_SIZE;
+
+    /* The default grows with the filesystem; with -d there is room for at least as many new inodes again */
+    if (inodes < 0) {
+        inodes = size / BYTES_PER_INODE;
+        if (inodes < MIN_INODES)
+            inodes = MIN_INODES;
+        if (inodes < (long long)populated)
+            inodes = populated;
+    }
+    if (source)
+        inodes += populated;
+
+    /* Inode numbers are table slots, so the table must reach the highest one */
+    inode_table_blocks = (inodes + ASSOOFS_START_INO + ASSOOFS_INODES_PER_BLOCK - 1) / ASSOOFS_INODES_PER_BLOCK;
+    bitmap_block_number = ASSOOFS_INODESTORE_BLOCK_NUMBER + inode_table_blocks;
+    bitmap_blocks = (blocks_count + ASSOOFS_BLOCKS_PER_GROUP - 1) / ASSOOFS_BLOCKS_PER_GROUP;
+    if (journal < 0)
+        journal = blocks_count >= 16 * DEFAULT_JOURNAL_BLOCKS ? DEFAULT_JOURNAL_BLOCKS : 0;
+    journal_blocks = journal;
+    journal_block_number = journal_blocks ? bitmap_block_number + bitmap_blocks : 0;
+    rootdir_datablock_number = bitmap_block_number + bitmap_blocks + journal_blocks;
+    reserved_blocks = blocks_count / 100 * reserved_percent + blocks_count % 100 * reserved_percent / 100;
+
+    if (layout()) {
+        close(fd);
+        return -1;
+    }
+    if (first_free_block >= blocks_count) {
+        printf("The device is too small: %llu blocks, %llu needed.\n", (unsigned long long)blocks_count, (unsigned long long)first_free_block + 1);
+        close(fd);
+        return -1;
+    }
+
+    batch = malloc(sizeof(*batch));
+    meta = aligned_alloc(ASSOOFS_DEFAULT_BLOCK_SIZE, META_BLOCKS * ASSOOFS_DEFAULT_BLOCK_SIZE);
+    stage = aligned_alloc(ASSOOFS_DEFAULT_BLOCK_SIZE, (size_t)BATCH_BLOCKS * ASSOOFS_DEFAULT_BLOCK_SIZE);
+    table = aligned_alloc(ASSOOFS_DEFAULT_BLOCK_SIZE, ((next_inode_no - 1) / ASSOOFS_INODES_PER_BLOCK + 1) * ASSOOFS_DEFAULT_BLOCK_SIZE);
+    if (!batch || !meta || !stage || !table) {
+        printf("Out of memory.\n");
+        close(fd);
+        return -1;
+    }
+    memset(table, 0, ((next_inode_no - 1) / ASSOOFS_INODES_PER_BLOCK + 1) * ASSOOFS_DEFAULT_BLOCK_SIZE);
+    memset(full_block, 0xff, sizeof(full_block));
+    batch->fd = fd;
+    batch->count = 0;
+
+    /* File data goes out from its own threads while this one writes the metadata in front of it */
+    copy.fd = fd;
+    if (nfiles) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads < 1)
+            nthreads = 1;
+        if (nthreads > COPY_THREADS)
+            nthreads = COPY_THREADS;
+        for (i = 0; i < nthreads; i++)
+            if (pthread_create(&threads[i], NULL, copy_thread, &copy))
+                break;
+        nthreads = i;
+        if (!nthreads)
+            copy_thread(&copy);
+    }
+
+    ret = -1;
     do {
-        if (write_superblock(fd))
+        /* Queued in disk order, so contiguous regions go out in a single call */
+        if (write_superblock(batch, (struct assoofs_super_block_info *)META(meta, META_SB)))
             break;
 
-        if (write_root_inode(fd))
+        if (write_inode_table(batch, table, zero_itable))
             break;
-        
-        if (write_welcome_inode(fd, &welcome))
+
+        if (write_bitmap(batch, META(meta, META_BITMAP)))
             break;
 
-        if (write_dirent(fd, &record))
+        if (write_journal(batch, META(meta, META_JOURNAL)))
             break;
-        
-        if (write_block(fd, welcomefile_body, welcome.file_size))
+
+        for (i = 0; i < (long)ndirs; i++)
+            if (write_dir(batch, dirs[i]))
+                break;
+        if (i < (long)ndirs)
+            break;
+
+        if (batch_flush(batch))
             break;
 
         ret = 0;
     } while (0);
 
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    if (copy.error || fsync(fd))
+        ret = -1;
+
+    if (!ret)
+        printf("assoofs: %llu blocks, %llu inode table blocks, %llu bitmap blocks, %llu journal blocks, %llu reserved blocks, %llu inodes and %llu data blocks in use.\n",
+               (unsigned long long)blocks_count, (unsigned long long)inode_table_blocks,
+               (unsigned long long)bitmap_blocks, (unsigned long long)journal_blocks,
+               (unsigned long long)reserved_blocks, (unsigned long long)populated + 1,
+               (unsigned long long)(first_free_block - rootdir_datablock_number));
+
+    free(table);
+    free(stage);
+    free(meta);
+    free(batch);
     close(fd);
     return ret;
 }